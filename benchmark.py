@@ -0,0 +1,319 @@
+#!/usr/bin/env python
+"""
+Benchmarks the pysander bindings: setting up a system, sending positions to
+sander, evaluating energies and forces, and retrieving positions. Every
+combination of extension module (sander, sanderles), input type (gas phase, GB
+models igb=1/2/5/8 and PME) and system size is run in its own process (sander
+keeps global state, and sander and sanderles cannot share a process), and the
+results are written as JSON so that runs from different releases can be
+compared with --compare.
+
+Unless a topology is given with --prmtop, the systems are boxes of water
+generated with ParmEd and cached in --workdir.
+
+Examples
+--------
+    python benchmark.py -o results.json
+    python benchmark.py --sizes 1000 10000 --inputs gas pme -o quick.json
+    python benchmark.py --compare results.json -o new.json
+"""
+from __future__ import print_function, division, absolute_import
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+# Name of each input type mapped to the igb value (None for PME)
+INPUTS = dict(gas=0, gb1=1, gb2=2, gb5=5, gb8=8, pme=None)
+MODULES = ('sander', 'sanderles')
+SIZES = (1000, 10000, 100000, 500000)
+OPERATIONS = ('set_positions', 'energy_forces', 'get_positions')
+
+# TIP3P-like water geometry and a lattice spacing that gives roughly liquid
+# density (~1 g/cm^3)
+_OH = 0.9572
+_HOH = np.radians(104.52)
+_SPACING = 3.1
+
+def water_box(natom):
+    """
+    Builds the coordinates of a cubic lattice of water molecules
+
+    Parameters
+    ----------
+    natom : int
+        Approximate number of atoms; rounded down to a multiple of 3
+
+    Returns
+    -------
+    coordinates, box : np.ndarray(natom, 3), list of 6 floats
+    """
+    nwat = max(natom // 3, 1)
+    nside = int(np.ceil(nwat ** (1/3)))
+    grid = np.indices((nside, nside, nside)).reshape(3, -1).T[:nwat]
+    oxygens = grid * _SPACING + _SPACING / 2
+    crd = np.empty((nwat, 3, 3))
+    crd[:,0] = oxygens
+    crd[:,1] = oxygens + [_OH, 0, 0]
+    crd[:,2] = oxygens + [_OH*np.cos(_HOH), _OH*np.sin(_HOH), 0]
+    length = nside * _SPACING
+    return crd.reshape(-1, 3), [length, length, length, 90.0, 90.0, 90.0]
+
+def water_prmtop(natom, workdir):
+    """
+    Writes (or reuses) a prmtop for the water box returned by water_box
+
+    Returns
+    -------
+    prmtop : str
+        The name of the topology file
+    """
+    nwat = max(natom // 3, 1)
+    fname = os.path.join(workdir, 'water_%d.parm7' % nwat)
+    if os.path.exists(fname):
+        return fname
+    import parmed as pmd
+    from parmed.topologyobjects import AngleType, AtomType, BondType, Angle, Bond
+    from parmed.amber import AmberParm
+
+    struct = pmd.Structure()
+    ow = AtomType('OW', 1, 16.00, 8)
+    ow.set_lj_params(0.1521, 1.7683)
+    hw = AtomType('HW', 2, 1.008, 1)
+    hw.set_lj_params(0.0, 0.0)
+    bond = BondType(553.0, _OH, list=struct.bond_types)
+    angle = AngleType(100.0, np.degrees(_HOH), list=struct.angle_types)
+    struct.bond_types.append(bond)
+    struct.angle_types.append(angle)
+    for i in range(nwat):
+        o = pmd.Atom(name='O', type='OW', charge=-0.834, mass=16.00,
+                     atomic_number=8, solvent_radius=1.5, screen=0.85)
+        h1 = pmd.Atom(name='H1', type='HW', charge=0.417, mass=1.008,
+                      atomic_number=1, solvent_radius=1.2, screen=0.85)
+        h2 = pmd.Atom(name='H2', type='HW', charge=0.417, mass=1.008,
+                      atomic_number=1, solvent_radius=1.2, screen=0.85)
+        o.atom_type, h1.atom_type, h2.atom_type = ow, hw, hw
+        for atom in (o, h1, h2):
+            struct.add_atom(atom, 'WAT', i + 1)
+        struct.bonds.append(Bond(o, h1, type=bond))
+        struct.bonds.append(Bond(o, h2, type=bond))
+        struct.angles.append(Angle(h1, o, h2, type=angle))
+    struct.box = water_box(3 * nwat)[1]
+    AmberParm.from_structure(struct).write_parm(fname)
+    return fname
+
+def _summarize(times):
+    times = np.asarray(times)
+    return dict(min=float(times.min()), median=float(np.median(times)),
+                mean=float(times.mean()), max=float(times.max()),
+                repeats=len(times))
+
+def run_case(case):
+    """
+    Runs a single benchmark case in the current process
+
+    Parameters
+    ----------
+    case : dict
+        module, input, natom, prmtop, repeats and cutoff (see main)
+
+    Returns
+    -------
+    result : dict
+        Timings (in seconds) of each operation along with the binding
+        counters reported by stats()
+    """
+    sander = __import__(case['module'])
+    coords, box = water_box(case['natom'])
+    if case.get('inpcrd'):
+        from parmed.amber import Rst7
+        rst = Rst7.open(case['inpcrd'])
+        coords = np.asarray(rst.coordinates, dtype=np.float64).reshape(-1, 3)
+        box = list(rst.box) if rst.box is not None else box
+    igb = INPUTS[case['input']]
+    if igb is None:
+        options = sander.pme_input()
+    else:
+        options = sander.gas_input(igb)
+        box = None
+    if case.get('cutoff') is not None:
+        options.cut = case['cutoff']
+    coords = np.ascontiguousarray(coords, dtype=np.float64)
+    rng = np.random.RandomState(1)
+    frames = [coords + rng.uniform(-0.01, 0.01, coords.shape)
+              for i in range(min(case['repeats'], 8))]
+
+    result = dict(natom=int(coords.shape[0]))
+    start = time.time()
+    sander.setup(case['prmtop'], coords, box, options)
+    result['setup'] = time.time() - start
+    try:
+        if sander.natom() != coords.shape[0]:
+            raise ValueError('%s has %d atoms, but %d coordinates were given' %
+                             (case['prmtop'], sander.natom(), coords.shape[0]))
+        # One evaluation first so lazy initialization is not timed
+        sander.energy_forces()
+        sander.reset_stats()
+        times = dict((op, []) for op in OPERATIONS)
+        positions = np.empty(coords.size)
+        for i in range(case['repeats']):
+            start = time.time()
+            sander.set_positions(frames[i % len(frames)])
+            times['set_positions'].append(time.time() - start)
+            start = time.time()
+            sander.energy_forces(as_numpy=True)
+            times['energy_forces'].append(time.time() - start)
+            start = time.time()
+            sander.get_positions(out=positions)
+            times['get_positions'].append(time.time() - start)
+        for op in OPERATIONS:
+            result[op] = _summarize(times[op])
+        result['stats'] = dict((op, sander.stats()[op]) for op in OPERATIONS)
+    finally:
+        sander.cleanup()
+    return result
+
+def _run_isolated(case, timeout):
+    """ Runs a case in a child process, so crashes are reported, not fatal """
+    cmd = [sys.executable, os.path.abspath(__file__), '--case', json.dumps(case)]
+    try:
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                                stderr=subprocess.PIPE, universal_newlines=True)
+        out, err = proc.communicate(timeout=timeout) if timeout else \
+                   proc.communicate()
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        proc.communicate()
+        return dict(error='timed out after %g s' % timeout)
+    if proc.returncode != 0:
+        lines = err.strip().splitlines()
+        return dict(error=lines[-1] if lines else
+                    'exited with status %d' % proc.returncode)
+    return json.loads(out.strip().splitlines()[-1])
+
+def compare(baseline, results, threshold):
+    """
+    Compares median timings against a previous run
+
+    Returns
+    -------
+    regressions : list of str
+        Descriptions of every timing that is more than threshold times slower
+        than in the baseline
+    """
+    def key(r):
+        return (r['module'], r['input'], r['system'])
+    old = dict((key(r), r) for r in baseline['results'] if 'error' not in r)
+    regressions = []
+    for r in results:
+        if 'error' in r or key(r) not in old:
+            continue
+        for op in OPERATIONS:
+            before = old[key(r)][op]['median']
+            after = r[op]['median']
+            if before > 0 and after / before > threshold:
+                regressions.append('%s %s %s %s: %.3g s -> %.3g s (%.2fx)' %
+                                   (key(r) + (op, before, after, after/before)))
+    return regressions
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0],
+                formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--modules', nargs='+', choices=MODULES,
+                        default=list(MODULES))
+    parser.add_argument('--inputs', nargs='+', choices=sorted(INPUTS),
+                        default=['gas', 'gb1', 'gb2', 'gb5', 'gb8', 'pme'])
+    parser.add_argument('--sizes', nargs='+', type=int, default=list(SIZES),
+                        help='Numbers of atoms of the generated water boxes')
+    parser.add_argument('--prmtop', help='Benchmark this topology instead of '
+                        'generated water boxes (requires --inpcrd)')
+    parser.add_argument('--inpcrd', help='Coordinates for --prmtop')
+    parser.add_argument('--repeats', type=int, default=10,
+                        help='Number of timed calls of each operation')
+    parser.add_argument('--cutoff', type=float, default=None,
+                        help='Nonbonded cutoff (default: that of gas_input or '
+                        'pme_input)')
+    parser.add_argument('--timeout', type=float, default=None,
+                        help='Seconds after which a case is abandoned')
+    parser.add_argument('--workdir', default='benchmark_systems',
+                        help='Where generated topologies are cached')
+    parser.add_argument('-o', '--output', help='JSON output file (default: '
+                        'standard output)')
+    parser.add_argument('--compare', metavar='BASELINE',
+                        help='JSON output of a previous run to compare with')
+    parser.add_argument('--threshold', type=float, default=1.2,
+                        help='Slowdown relative to BASELINE that counts as a '
+                        'regression')
+    parser.add_argument('--case', help=argparse.SUPPRESS)
+    args = parser.parse_args(argv)
+
+    if args.case is not None:
+        # Import the installed extensions, not the sources next to this script
+        here = os.path.dirname(os.path.abspath(__file__))
+        sys.path = [p for p in sys.path
+                    if os.path.abspath(p or os.curdir) != here]
+        print(json.dumps(run_case(json.loads(args.case))))
+        return 0
+
+    if bool(args.prmtop) != bool(args.inpcrd):
+        parser.error('--prmtop and --inpcrd must be given together')
+    if args.prmtop:
+        systems = [(os.path.basename(args.prmtop), None)]
+    else:
+        if not os.path.isdir(args.workdir):
+            os.makedirs(args.workdir)
+        systems = [('water_%d' % n, n) for n in args.sizes]
+
+    results = []
+    for name, natom in systems:
+        if natom is None:
+            prmtop = os.path.abspath(args.prmtop)
+        else:
+            prmtop = os.path.abspath(water_prmtop(natom, args.workdir))
+        for module in args.modules:
+            for inp in args.inputs:
+                case = dict(module=module, input=inp, natom=natom or 0,
+                            prmtop=prmtop, repeats=args.repeats,
+                            cutoff=args.cutoff, inpcrd=args.inpcrd and
+                            os.path.abspath(args.inpcrd))
+                sys.stderr.write('%-10s %-4s %-20s ' % (module, inp, name))
+                sys.stderr.flush()
+                result = _run_isolated(case, args.timeout)
+                result.update(module=module, input=inp, system=name)
+                if 'error' in result:
+                    sys.stderr.write('ERROR: %s\n' % result['error'])
+                else:
+                    sys.stderr.write('energy_forces %.4g s\n' %
+                                     result['energy_forces']['median'])
+                results.append(result)
+
+    report = dict(
+        created=time.strftime('%Y-%m-%dT%H:%M:%S'),
+        python=platform.python_version(), numpy=np.__version__,
+        platform=platform.platform(), machine=platform.machine(),
+        processor=platform.processor(), repeats=args.repeats,
+        results=results,
+    )
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+    else:
+        print(json.dumps(report, indent=2, sort_keys=True))
+
+    if args.compare:
+        with open(args.compare) as f:
+            regressions = compare(json.load(f), results, args.threshold)
+        for line in regressions:
+            sys.stderr.write('REGRESSION %s\n' % line)
+        if regressions:
+            return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
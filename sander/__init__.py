@@ -1,5 +1,10 @@
 from __future__ import print_function, division, absolute_import
+import atexit as _atexit
+from collections import OrderedDict as _OrderedDict, namedtuple as _namedtuple
+import hashlib as _hashlib
+import os as _os
 import tempfile
+import weakref as _weakref
 from parmed.amber import AmberParm, Rst7
 from parmed import unit as u
 from parmed.utils.six import string_types
@@ -7,8 +12,15 @@ import numpy as _np
 from sys import stderr as _stderr
 
 __all__ = ['InputOptions', 'QmInputOptions', 'setup', 'cleanup', 'pme_input',
-           'gas_input', 'natom', 'energy_forces', 'set_positions', 'set_box',
-           'is_setup', 'EnergyTerms']
+           'gas_input', 'natom', 'energy_forces', 'set_positions',
+           'update_positions', 'set_box', 'is_setup', 'EnergyTerms',
+           'energy_forces_batch', 'ENERGY_TERMS', 'iter_trajectory', 'Pool',
+           'Session', 'stats', 'reset_stats', 'evaluate', 'minimize',
+           'MinimizeResult', 'dynamics', 'DynamicsResult', 'hessian',
+           'HessianResult', 'set_groups', 'energy_forces_groups', 'Evaluator',
+           'evaluate_async', 'energy_forces_async', 'set_cache', 'clear_cache',
+           'cache_info', 'monte_carlo', 'MonteCarloResult', 'DatasetWriter',
+           'DatasetReader']
 
 try:
     from . import pysander as _pys
@@ -31,6 +43,17 @@ pme_input = _pys.pme_input
 gas_input = _pys.gas_input
 natom = _pys.natom
 is_setup = _pys.is_setup
+setup_count = _pys.setup_count
+# Per-entry-point timing counters of the binding layer
+stats = _pys.stats
+reset_stats = _pys.reset_stats
+# Opt-in cache of energy_forces and evaluate results, keyed on the positions
+# and box
+set_cache = _pys.set_cache
+clear_cache = _pys.clear_cache
+cache_info = _pys.cache_info
+# Names of the columns of the energy arrays returned by energy_forces_batch
+ENERGY_TERMS = _pys.ENERGY_TERMS
 
 # To help with dimensional analysis handling
 def _strip_units(obj):
@@ -51,13 +74,130 @@ def _strip_units_from_struct(struct):
         setattr(struct, attr, val)
     return struct
 
+class _UnitStruct(object):
+    """ Plain attribute container for struct members that carry units """
+
 def _apply_units_to_struct(struct, unit):
-    """ Applies the given unit to all members of the struct """
+    """
+    Returns a copy of the struct with the given unit applied to all members.
+    A copy is needed since EnergyTerms members can only hold plain floats
+    """
+    ret = _UnitStruct()
     for attr in dir(struct):
         if attr.startswith('_'): continue
         val = getattr(struct, attr)
-        setattr(struct, attr, val*unit)
-    return struct
+        setattr(ret, attr, val*unit)
+    return ret
+
+# Serialized AmberParm topologies, keyed by a hash of the written prmtop. Each
+# value is a (file descriptor, path) pair. Where possible the prmtop is held in
+# an anonymous in-memory file (memfd) so it never touches a file system;
+# otherwise it is written to a temporary file (in /dev/shm, if available) that
+# is deleted when it is evicted from the cache or when Python exits
+_PARM_CACHE = _OrderedDict()
+_PARM_CACHE_SIZE = 4
+
+# The _PARM_CACHE key of every AmberParm serialized so far, keyed by id(parm).
+# Each value is a (weak reference, key) pair, so an entry goes away with its
+# AmberParm and a recycled id is never mistaken for the old object
+_PARM_KEYS = dict()
+
+def _release_parm(entry):
+    fd, path = entry
+    _os.close(fd)
+    if not path.startswith('/proc/'):
+        _os.unlink(path)
+
+@_atexit.register
+def _clear_parm_cache():
+    while _PARM_CACHE:
+        _release_parm(_PARM_CACHE.popitem()[1])
+
+def _forget_parm(ident, ref):
+    if _PARM_KEYS.get(ident, (None,))[0] is ref:
+        del _PARM_KEYS[ident]
+
+def _parm_key(parm):
+    """
+    Returns the _PARM_CACHE key of an AmberParm. Each AmberParm object is
+    serialized with write_parm only the first time it is seen, and the file is
+    hashed so that identical topologies share one cache entry
+    """
+    entry = _PARM_KEYS.get(id(parm))
+    if entry is not None and entry[0]() is parm and entry[1] in _PARM_CACHE:
+        key = entry[1]
+        _PARM_CACHE[key] = _PARM_CACHE.pop(key) # Mark as recently used
+        return key
+    if hasattr(_os, 'memfd_create') and _os.path.isdir('/proc/self/fd'):
+        fd = _os.memfd_create('prmtop')
+        path = '/proc/self/fd/%d' % fd
+    else:
+        tmpdir = '/dev/shm' if _os.path.isdir('/dev/shm') else None
+        fd, path = tempfile.mkstemp(suffix='.parm7', dir=tmpdir)
+    try:
+        parm.write_parm(path)
+        digest = _hashlib.sha1()
+        with open(path, 'rb') as f:
+            for block in iter(lambda: f.read(1 << 20), b''):
+                digest.update(block)
+    except:
+        _release_parm((fd, path))
+        raise
+    key = digest.hexdigest()
+    if key in _PARM_CACHE:
+        _release_parm((fd, path))
+        _PARM_CACHE[key] = _PARM_CACHE.pop(key)
+    else:
+        _PARM_CACHE[key] = (fd, path)
+        while len(_PARM_CACHE) > _PARM_CACHE_SIZE:
+            _release_parm(_PARM_CACHE.popitem(last=False)[1])
+    ref = _weakref.ref(parm, lambda ref, ident=id(parm):
+                                 _forget_parm(ident, ref))
+    _PARM_KEYS[id(parm)] = (ref, key)
+    return key
+
+def _prmtop_path(parm):
+    """
+    Returns the name of a file sander can read the AmberParm from. See
+    _parm_key for when it is serialized
+    """
+    return _PARM_CACHE[_parm_key(parm)][1]
+
+# The topology and options the active system was set up with, and the
+# setup_count they belong to, so per-atom data (e.g., masses) can be looked up,
+# or the system recreated, without the caller having to pass them again
+_ACTIVE = dict(prmtop=None, count=None, parm=None, mm_options=None,
+               qm_options=None)
+
+def _set_active_prmtop(prmtop, mm_options=None, qm_options=None):
+    _ACTIVE.update(prmtop=prmtop, count=_pys.setup_count(), parm=None,
+                   mm_options=_struct_to_dict(mm_options),
+                   qm_options=_struct_to_dict(qm_options))
+
+def _check_active():
+    if not _pys.is_setup() or _ACTIVE['count'] != _pys.setup_count():
+        raise RuntimeError('The topology of the active system is not known; '
+                           'pass the required data explicitly')
+
+def _active_setup():
+    """
+    Returns the prmtop (file name or AmberParm), mm_options and qm_options the
+    active system was set up with
+    """
+    _check_active()
+    return (_ACTIVE['prmtop'],
+            _struct_from_dict(InputOptions, _ACTIVE['mm_options']),
+            _struct_from_dict(QmInputOptions, _ACTIVE['qm_options']))
+
+def _active_parm():
+    """ Returns an AmberParm for the active system """
+    _check_active()
+    if _ACTIVE['parm'] is None:
+        prmtop = _ACTIVE['prmtop']
+        if not isinstance(prmtop, AmberParm):
+            prmtop = AmberParm(prmtop)
+        _ACTIVE['parm'] = prmtop
+    return _ACTIVE['parm']
 
 def qm_input():
     """
@@ -66,7 +206,56 @@ def qm_input():
     """
     return QmInputOptions()
 
-def set_positions(positions):
+def _coords_array(coords):
+    """
+    Returns coordinates as a C-contiguous array the extension module reads
+    directly: float32 arrays are kept as they are (and converted in C), and
+    anything else becomes float64
+    """
+    if u.is_quantity(coords):
+        coords = coords.value_in_unit(u.angstroms)
+    if getattr(coords, 'dtype', None) == _np.float32:
+        return _np.ascontiguousarray(coords)
+    return _np.ascontiguousarray(coords, dtype=_np.float64)
+
+def _coords_out(out, dtype, soa, natom=None):
+    """
+    Returns the array coordinates should be written into: out if given, a new
+    array if a non-default precision or layout is requested, or None (a list)
+    """
+    if out is not None or (dtype is None and not soa):
+        return out
+    if natom is None:
+        natom = _pys.natom()
+    return _np.empty((3, natom) if soa else natom * 3,
+                     dtype=_np.float64 if dtype is None else dtype)
+
+# Atom selections resolved by _atom_indices for the active system
+_SELECTIONS = dict(count=None, cache=dict())
+
+def _atom_indices(atoms):
+    """
+    Converts an atom selection (an Amber mask string or atom indices) into the
+    index array the extension module reads. Masks are resolved against the
+    topology of the active system once, and cached until it is replaced
+    """
+    if atoms is None:
+        return None
+    if isinstance(atoms, string_types):
+        count = _pys.setup_count()
+        if _SELECTIONS['count'] != count:
+            _SELECTIONS.update(count=count, cache=dict())
+        cache = _SELECTIONS['cache']
+        if atoms not in cache:
+            from parmed.amber import AmberMask
+            sel = AmberMask(_active_parm(), atoms).Selected()
+            cache[atoms] = _np.fromiter(sel, dtype=_np.intp)
+        return cache[atoms]
+    if isinstance(atoms, _np.ndarray) and atoms.dtype in (_np.int32, _np.int64):
+        return _np.ascontiguousarray(atoms)
+    return _np.ascontiguousarray(atoms, dtype=_np.intp)
+
+def set_positions(positions, soa=False):
     """
     Sets the particle positions of the active system from the passed list of
     positions. Supports both lists, numpy.ndarray and numpy.ndarray objects
@@ -75,22 +264,42 @@ def set_positions(positions):
     ----------
     positions : array of float
         The atomic positions. They can have units of length. They can have the
-        shapes (natom*3,) or (natom, 3)
-    """
-    if u.is_quantity(positions):
-        positions = positions.value_in_unit(u.angstroms)
-    # Common input types will have an natom x 3 shape. I can call "flatten" on
-    # numpy arrays to solve this quickly, but in cases where the coordinates
-    # are given as a list (or tuple) of Vec3's (or tuples), this requires
-    # separate handling
-    positions = _np.array(positions, copy=False, subok=True)
-    positions = positions.flatten()
+        shapes (natom*3,) or (natom, 3), or (3, natom) if soa is True. float64
+        and float32 arrays are read directly
+    soa : bool, optional
+        If True, positions holds all x, then all y, then all z coordinates
+        (structure of arrays) instead of x, y, z of each atom
+    """
+    # Common input types will have an natom x 3 shape. A C-contiguous float64
+    # array has the same memory layout as the flattened coordinates, so it is
+    # passed straight through to sander without a copy. float32 arrays and the
+    # SoA layout are converted in C. Anything else (lists or tuples of Vec3's,
+    # strided views) is converted once
+    positions = _coords_array(positions)
     natom = _pys.natom()
-    if len(positions) != natom * 3:
+    if positions.size != natom * 3:
         raise ValueError('Positions array must have natom*3 elements')
-    return _pys.set_positions(positions.tolist())
+    return _pys.set_positions(positions, int(soa))
 
-def get_positions(as_numpy=False):
+def update_positions(indices, coords):
+    """
+    Moves a subset of the atoms of the active system, leaving all others where
+    they are. Only the moved atoms cross into the extension module, which
+    patches them into its own copy of the positions, so the cost scales with
+    the number of atoms moved (e.g., one residue in a Monte Carlo step) rather
+    than the size of the system
+
+    Parameters
+    ----------
+    indices : str or array of int
+        An Amber mask or the (0-based) indices of the atoms to move
+    coords : array of float
+        The new positions of those atoms, with shape (n, 3) or (n*3,). They
+        can have units of length. float64 and float32 arrays are read directly
+    """
+    return _pys.update_positions(_atom_indices(indices), _coords_array(coords))
+
+def get_positions(as_numpy=False, out=None, dtype=None, soa=False):
     """ Returns the current atomic positions loaded in the sander API
 
     Parameters
@@ -98,6 +307,16 @@ def get_positions(as_numpy=False):
     as_numpy : bool, optional
         If True, the positions will be returned as a natom*3-length numpy array.
         If False (default), it will be returned as a natom*3-length Python list.
+    out : array of float, optional
+        A writable, C-contiguous float64 or float32 array (or other buffer)
+        with natom*3 elements. If given, the positions are written directly
+        into it and it is returned, so no new objects are allocated.
+    dtype : np.float32 or np.float64, optional
+        If given (and out is not), the positions are returned as a new array
+        of this type
+    soa : bool, optional
+        If True, all x, then all y, then all z coordinates are returned (as a
+        (3, natom) array if a new array is allocated)
 
     Returns
     -------
@@ -107,14 +326,14 @@ def get_positions(as_numpy=False):
         the units chemistry.unit.angstroms
     """
     global APPLY_UNITS
-    positions = _pys.get_positions()
+    positions = _pys.get_positions(_coords_out(out, dtype, soa), int(soa))
     if as_numpy:
         positions = _np.asarray(positions)
     if APPLY_UNITS:
         return u.Quantity(positions, u.angstrom)
     return positions
 
-def energy_forces(as_numpy=False):
+def energy_forces(as_numpy=False, out=None, dtype=None, soa=False, atoms=None):
     """
     Returns the energies and forces of the current conformation with the current
     Hamiltonian.
@@ -124,6 +343,21 @@ def energy_forces(as_numpy=False):
     as_numpy : bool, optional
         If True, the forces will be returned as a natom*3-length numpy array. If
         False (default), they will be returned as a natom*3-length Python list.
+    out : array of float, optional
+        A writable, C-contiguous float64 or float32 array (or other buffer) with
+        natom*3 elements. If given, the forces are written into it and it is
+        returned in place of a newly allocated list (sander writes float64
+        output in the default layout directly).
+    dtype : np.float32 or np.float64, optional
+        If given (and out is not), the forces are returned as a new array of
+        this type, converted in C
+    soa : bool, optional
+        If True, all x, then all y, then all z components are returned (as a
+        (3, natom) array if a new array is allocated)
+    atoms : str or array of int, optional
+        An Amber mask or the (0-based) indices of the atoms whose forces are
+        returned. Masks are resolved once per set-up system. Default is all
+        atoms
 
     Returns
     -------
@@ -135,7 +369,60 @@ def energy_forces(as_numpy=False):
         kilocalories_per_mole/u.angstroms
     """
     global APPLY_UNITS
-    e, f = _pys.energy_forces()
+    atoms = _atom_indices(atoms)
+    out = _coords_out(out, dtype, soa, None if atoms is None else len(atoms))
+    e, f = _pys.energy_forces(out, int(soa), atoms)
+    if as_numpy:
+        f = _np.asarray(f)
+    if APPLY_UNITS:
+        return (_apply_units_to_struct(e, u.kilocalories_per_mole),
+                u.Quantity(f, u.kilocalories_per_mole/u.angstroms))
+    return e, f
+
+def evaluate(positions, box=None, as_numpy=False, out=None, dtype=None,
+             soa=False, atoms=None):
+    """
+    Sets the positions (and optionally the unit cell) of the active system and
+    returns its energies and forces. This is equivalent to calling
+    set_positions, set_box and energy_forces in turn, but crosses into the
+    extension module only once, which matters when each evaluation is cheap
+    (e.g., small QM/MM regions).
+
+    Parameters
+    ----------
+    positions : array of float
+        The atomic positions with the shape (natom*3,) or (natom, 3). They can
+        have units of length. C-contiguous float64 arrays are used in place
+    box : tuple of 6 floats, optional
+        The unit cell lengths (Angstroms) and angles (degrees). If None
+        (default), the box is not changed
+    as_numpy : bool, optional
+        If True, the forces will be returned as a natom*3-length numpy array
+    out : array of float, optional
+        A writable, C-contiguous float64 or float32 array with natom*3 elements
+        that the forces are written into and which is returned
+    dtype : np.float32 or np.float64, optional
+        If given (and out is not), the forces are returned as a new array of
+        this type
+    soa : bool, optional
+        If True, positions and forces hold all x, then all y, then all z
+        components (structure of arrays)
+    atoms : str or array of int, optional
+        An Amber mask or the indices of the atoms whose forces are returned
+
+    Returns
+    -------
+    energy, forces : EnergyTerms, array of float
+        See energy_forces
+    """
+    global APPLY_UNITS
+    positions = _coords_array(positions)
+    if box is not None:
+        box = tuple(x.value_in_unit(u.angstroms if i < 3 else u.degrees)
+                    if u.is_quantity(x) else float(x) for i, x in enumerate(box))
+    atoms = _atom_indices(atoms)
+    out = _coords_out(out, dtype, soa, None if atoms is None else len(atoms))
+    e, f = _pys.evaluate(positions, box, out, int(soa), atoms)
     if as_numpy:
         f = _np.asarray(f)
     if APPLY_UNITS:
@@ -143,6 +430,564 @@ def energy_forces(as_numpy=False):
                 u.Quantity(f, u.kilocalories_per_mole/u.angstroms))
     return e, f
 
+def energy_forces_batch(frames, boxes=None, forces=True):
+    """
+    Computes the energies (and forces) of many frames in a single call. The
+    loop over the frames runs entirely inside the extension module, so there is
+    no per-frame Python overhead. When this returns, the last frame (and box)
+    is left as the active conformation.
+
+    Parameters
+    ----------
+    frames : array of float
+        The atomic positions of every frame, with shape (nframes, natom, 3) or
+        (nframes, natom*3). They can have units of length
+    boxes : array of float, optional
+        Unit cell dimensions (a, b, c, alpha, beta, gamma) of every frame with
+        shape (nframes, 6), e.g., for trajectories run at constant pressure. If
+        None (default), the box of the active system is used for every frame
+    forces : bool, optional
+        If True (default), the forces of every frame are computed and returned.
+        If False, only the energies are returned
+
+    Returns
+    -------
+    energies, forces : np.ndarray, np.ndarray or None
+        energies has shape (nframes, len(ENERGY_TERMS)) with the energy terms
+        of each frame in the order given by sander.ENERGY_TERMS. forces has
+        shape (nframes, natom, 3), or is None if forces were not requested. If
+        sander.APPLY_UNITS is True, the energies will have the units
+        kilocalories_per_mole applied, and forces will have the units
+        kilocalories_per_mole/u.angstroms
+    """
+    global APPLY_UNITS
+    if u.is_quantity(frames):
+        frames = frames.value_in_unit(u.angstroms)
+    frames = _np.ascontiguousarray(frames, dtype=_np.float64)
+    natom = _pys.natom()
+    if frames.size % (natom * 3) != 0:
+        raise ValueError('frames must have nframes*natom*3 elements')
+    nframes = frames.size // (natom * 3)
+    if boxes is not None:
+        boxes = _np.ascontiguousarray(boxes, dtype=_np.float64)
+        if boxes.shape != (nframes, 6):
+            raise ValueError('boxes must have shape (nframes, 6)')
+    ene = _np.empty((nframes, len(ENERGY_TERMS)))
+    frc = _np.empty((nframes, natom, 3)) if forces else None
+    _pys.energy_forces_batch(frames, boxes, ene, frc)
+    if APPLY_UNITS:
+        ene = u.Quantity(ene, u.kilocalories_per_mole)
+        if frc is not None:
+            frc = u.Quantity(frc, u.kilocalories_per_mole/u.angstroms)
+    return ene, frc
+
+def _trajectory_format(filename):
+    """ Determines the trajectory format code from the file's magic number """
+    with open(filename, 'rb') as f:
+        magic = f.read(4)
+    # NetCDF 3 files start with CDF, NetCDF 4 (HDF5) files with \x89HDF
+    if magic[:3] == b'CDF' or magic == b'\x89HDF':
+        return 0
+    return 1
+
+def iter_trajectory(filename, chunk_size=1000, forces=False, format=None):
+    """
+    Computes the energies (and forces) of every frame in a trajectory file,
+    streaming it in chunks so that memory use does not depend on the length of
+    the trajectory. Reading and evaluating frames happens inside the extension
+    module without the GIL. The trajectory must match the active system.
+
+    Parameters
+    ----------
+    filename : str
+        Name of an Amber NetCDF or ASCII mdcrd trajectory file
+    chunk_size : int, optional
+        Maximum number of frames read and evaluated at once (default 1000)
+    forces : bool, optional
+        If True, the forces are returned for every frame as well. Default False
+    format : str, optional
+        Either 'netcdf' or 'mdcrd'. If None (default), it is detected from the
+        contents of the file. mdcrd frames are assumed to have a box line if
+        the active system has a unit cell
+
+    Yields
+    ------
+    energies, forces : np.ndarray, np.ndarray or None
+        For each chunk, energies has shape (nframes, len(ENERGY_TERMS)) and
+        forces has shape (nframes, natom, 3) (or is None if forces were not
+        requested)
+    """
+    if format is None:
+        format = _trajectory_format(filename)
+    elif format in ('netcdf', 'mdcrd'):
+        format = 0 if format == 'netcdf' else 1
+    else:
+        raise ValueError("format must be 'netcdf' or 'mdcrd'")
+    has_box = format == 1 and _pys.get_box()[0] > 0
+    traj = _pys.Trajectory(filename, format, chunk_size, has_box)
+    try:
+        while True:
+            ene = _np.empty((chunk_size, len(ENERGY_TERMS)))
+            frc = _np.empty((chunk_size, traj.natom, 3)) if forces else None
+            nframes = traj.evaluate(ene, frc)
+            if nframes == 0:
+                break
+            if nframes < chunk_size:
+                ene = ene[:nframes]
+                if frc is not None:
+                    frc = frc[:nframes]
+            yield ene, frc
+    finally:
+        traj.close()
+
+MinimizeResult = _namedtuple('MinimizeResult', 'positions energy niter converged '
+                             'nevals log')
+MinimizeResult.__doc__ = """
+The outcome of minimize
+
+Attributes
+----------
+positions : np.ndarray (natom, 3)
+    The final structure
+energy : EnergyTerms
+    The energy components of the final structure
+niter : int
+    The number of iterations taken
+converged : bool
+    Whether the force thresholds were met
+nevals : int
+    The number of energy and force evaluations
+log : np.ndarray (niter+1, 5) or None
+    Energy, RMS force, max force, largest displacement and method (0 for
+    L-BFGS, 1 for FIRE) of the starting structure and each iteration
+"""
+
+_MINIMIZERS = dict(lbfgs=0, fire=1)
+
+def _frozen_flags(frozen, natom):
+    """
+    Converts a mask or list of indices of frozen atoms into the one byte per
+    atom the extension module expects (None stays None)
+    """
+    if frozen is None:
+        return None
+    frozen = _np.asarray(frozen)
+    if frozen.dtype != _np.bool_:
+        mask = _np.zeros(natom, dtype=_np.bool_)
+        mask[frozen] = True
+        frozen = mask
+    return _np.ascontiguousarray(frozen, dtype=_np.uint8)
+
+def minimize(positions=None, frozen=None, method='lbfgs', maxiter=1000,
+             rms_force=1e-2, max_force=5e-2, max_step=0.2, memory=10, log=True):
+    """
+    Minimizes the energy of the active system. The optimization loop runs
+    inside the extension module, calling sander directly for every energy and
+    force evaluation, so there is no Python overhead per step. The final
+    structure is left as the active conformation.
+
+    Parameters
+    ----------
+    positions : array of float, optional
+        The starting structure (natom*3 or (natom, 3), can have units). The
+        default is the current conformation
+    frozen : array of bool or iterable of int, optional
+        A mask with one entry per atom, or the indices of the atoms, that are
+        held fixed
+    method : str, optional
+        'lbfgs' (default) uses L-BFGS, and switches to FIRE if the line search
+        keeps failing. 'fire' uses only FIRE
+    maxiter : int, optional
+        The maximum number of iterations
+    rms_force : float, optional
+        Converged when the RMS force (over moving atoms) is below this value
+        in kcal/mol/Angstrom and ...
+    max_force : float, optional
+        ... the largest force component is below this value
+    max_step : float, optional
+        The largest displacement (in Angstroms) of any coordinate in a step
+    memory : int, optional
+        The number of correction pairs stored by L-BFGS
+    log : bool, optional
+        If True (default), record the progress of every iteration
+
+    Returns
+    -------
+    result : MinimizeResult
+    """
+    try:
+        method = _MINIMIZERS[method.lower()]
+    except KeyError:
+        raise ValueError('method must be one of %s' % ', '.join(_MINIMIZERS))
+    natom = _pys.natom()
+    if positions is None:
+        x = _np.empty(natom * 3)
+        _pys.get_positions(x)
+    else:
+        if u.is_quantity(positions):
+            positions = positions.value_in_unit(u.angstroms)
+        # Always copy, since the minimizer overwrites the coordinates
+        x = _np.array(positions, dtype=_np.float64).ravel()
+    frozen = _frozen_flags(frozen, natom)
+    log_array = _np.zeros((maxiter + 1, 5)) if log else None
+    ene, niter, status, nevals = _pys.minimize(x, frozen, method, maxiter,
+                                               rms_force, max_force, max_step,
+                                               memory, log_array)
+    if log_array is not None:
+        log_array = log_array[:niter+1]
+    if APPLY_UNITS:
+        ene = _apply_units_to_struct(ene, u.kilocalories_per_mole)
+    return MinimizeResult(x.reshape((natom, 3)), ene, niter, status == 0,
+                          nevals, log_array)
+
+DynamicsResult = _namedtuple('DynamicsResult', 'positions velocities frames '
+                             'energies kinetic temperature energy')
+DynamicsResult.__doc__ = """
+The outcome of dynamics
+
+Attributes
+----------
+positions, velocities : np.ndarray (natom, 3)
+    The final positions (Angstroms) and velocities (Angstroms/ps)
+frames : np.ndarray (nframes, natom, 3)
+    The positions of every written step (a memory-mapped .npy file if a
+    trajectory file name was given)
+energies : np.ndarray (nframes, len(ENERGY_TERMS))
+    The potential energy terms of every written step
+kinetic, temperature : np.ndarray (nframes,)
+    The kinetic energy (kcal/mol) and instantaneous temperature (K) of every
+    written step. The temperature counts 3 degrees of freedom for every atom
+    that is not frozen
+energy : EnergyTerms
+    The potential energy terms of the last step
+"""
+
+def dynamics(nsteps, dt=1.0, temperature=300.0, gamma=1.0, nwrite=100,
+             positions=None, velocities=None, masses=None, seed=None,
+             trajectory=None, frozen=None):
+    """
+    Runs molecular dynamics on the active system with velocity Verlet and a
+    Langevin thermostat. The integration loop runs inside the extension module,
+    so the interpreter is not involved in any step, and only every nwrite-th
+    step is stored. The final structure is left as the active conformation.
+
+    Parameters
+    ----------
+    nsteps : int
+        The number of steps
+    dt : float, optional
+        The time step in femtoseconds
+    temperature : float, optional
+        The thermostat temperature in Kelvin, also used for initial velocities
+    gamma : float, optional
+        The Langevin collision frequency in 1/ps. 0 runs NVE dynamics
+    nwrite : int, optional
+        Store positions and energies every this many steps
+    positions : array of float, optional
+        The starting structure. Default is the current conformation
+    velocities : array of float, optional
+        The starting velocities in Angstroms/ps. By default, they are drawn
+        from the Maxwell-Boltzmann distribution at temperature
+    masses : array of float, optional
+        The atomic masses in amu. By default, they are taken from the topology
+        the active system was set up with. They must all be positive, so
+        systems with massless extra points (e.g., TIP4P/TIP5P water) cannot be
+        run (sander only positions extra points in its own MD loop)
+    seed : int, optional
+        Seed of the random number generator (random if not given)
+    trajectory : str, optional
+        If given, the stored frames are written to this .npy file (memory
+        mapped) instead of being kept in memory
+    frozen : array of bool or iterable of int, optional
+        A mask with one entry per atom, or the indices of the atoms, that are
+        held fixed (their velocities are set to 0)
+
+    Returns
+    -------
+    result : DynamicsResult
+    """
+    natom = _pys.natom()
+    nframes = nsteps // nwrite if nwrite > 0 else 0
+    if positions is None:
+        x = _np.empty(natom * 3)
+        _pys.get_positions(x)
+    else:
+        if u.is_quantity(positions):
+            positions = positions.value_in_unit(u.angstroms)
+        x = _np.array(positions, dtype=_np.float64).ravel()
+    if velocities is None:
+        v = _np.zeros(natom * 3)
+    else:
+        v = _np.array(velocities, dtype=_np.float64).ravel()
+    if masses is None:
+        masses = _active_parm().parm_data['MASS']
+    masses = _np.ascontiguousarray(masses, dtype=_np.float64)
+    frozen = _frozen_flags(frozen, natom)
+    if seed is None:
+        seed = int(_np.frombuffer(_os.urandom(8), dtype=_np.uint64)[0])
+    if trajectory is not None:
+        frames = _np.lib.format.open_memmap(trajectory, mode='w+',
+                        dtype=_np.float64, shape=(nframes, natom, 3))
+    else:
+        frames = _np.empty((nframes, natom, 3))
+    energies = _np.empty((nframes, len(ENERGY_TERMS)))
+    kinetic = _np.empty(nframes)
+    have_frames = nframes > 0
+    ene, nframes = _pys.dynamics(x, v, masses, nsteps, dt * 1e-3, temperature,
+                                 gamma, seed, nwrite,
+                                 frames if have_frames else None,
+                                 energies if have_frames else None,
+                                 kinetic if have_frames else None,
+                                 int(velocities is None), frozen)
+    if trajectory is not None:
+        frames.flush()
+    ndof = 3 * natom
+    if frozen is not None:
+        ndof -= 3 * int(_np.count_nonzero(frozen))
+    if ndof > 0:
+        temp = 2 * kinetic / (ndof * 0.0019872041)
+    else:
+        temp = _np.zeros_like(kinetic)
+    if APPLY_UNITS:
+        ene = _apply_units_to_struct(ene, u.kilocalories_per_mole)
+    return DynamicsResult(x.reshape((natom, 3)), v.reshape((natom, 3)), frames,
+                          energies, kinetic, temp, ene)
+
+MonteCarloResult = _namedtuple('MonteCarloResult', 'positions frames energies '
+                               'attempted accepted acceptance energy')
+MonteCarloResult.__doc__ = """
+The outcome of monte_carlo
+
+Attributes
+----------
+positions : np.ndarray (natom, 3)
+    The final structure
+frames : np.ndarray (nframes, natom, 3)
+    The structure at every written step (a memory-mapped .npy file if a
+    trajectory file name was given)
+energies : np.ndarray (nframes, len(ENERGY_TERMS))
+    The potential energy terms at every written step
+attempted, accepted : np.ndarray (nmoves,)
+    How often each move was tried and accepted
+acceptance : np.ndarray (nmoves,)
+    The fraction of accepted trials of each move (nan if never tried)
+energy : EnergyTerms
+    The potential energy terms of the final structure
+"""
+
+# Move types understood by the extension module
+_MC_MOVES = dict(translate=0, rotate=1, torsion=2)
+
+def monte_carlo(nsteps, moves, temperature=300.0, nwrite=100, positions=None,
+                seed=None, trajectory=None):
+    """
+    Runs Metropolis Monte Carlo on the active system. Every step applies one of
+    the moves, chosen at random, with a random magnitude, and accepts or
+    rejects the result by its energy. The whole loop runs inside the extension
+    module, and only every nwrite-th step is stored. The final structure is
+    left as the active conformation.
+
+    Parameters
+    ----------
+    nsteps : int
+        The number of steps
+    moves : list of tuple
+        The move set. Each move is a tuple (kind, atoms, size[, axis]), where
+        atoms (an Amber mask or atom indices) are moved together, and kind is
+
+            - 'translate': a rigid translation by up to size Angstroms along
+              each Cartesian axis
+            - 'rotate': a rigid rotation by up to size degrees about a random
+              axis through the center of geometry of atoms
+            - 'torsion': a rotation by up to size degrees about the bond
+              between the two atoms in axis (e.g., the side of a dihedral that
+              atoms is on)
+    temperature : float, optional
+        The temperature in Kelvin
+    nwrite : int, optional
+        Store the structure and energies every this many steps
+    positions : array of float, optional
+        The starting structure. Default is the current conformation
+    seed : int, optional
+        Seed of the random number generator (random if not given)
+    trajectory : str, optional
+        If given, the stored frames are written to this .npy file (memory
+        mapped) instead of being kept in memory
+
+    Returns
+    -------
+    result : MonteCarloResult
+    """
+    natom = _pys.natom()
+    nframes = nsteps // nwrite if nwrite > 0 else 0
+    types, sizes, axes, starts, atoms = [], [], [], [0], []
+    for move in moves:
+        kind, sel, size = move[:3]
+        if kind not in _MC_MOVES:
+            raise ValueError('Unknown move %r; expected one of %s' %
+                             (kind, ', '.join(sorted(_MC_MOVES))))
+        if kind == 'torsion':
+            if len(move) < 4 or len(move[3]) != 2:
+                raise ValueError('torsion moves need an axis of two atoms')
+            axes.extend(move[3])
+        else:
+            axes.extend((0, 0))
+        types.append(_MC_MOVES[kind])
+        sizes.append(size if kind == 'translate' else _np.radians(size))
+        sel = _atom_indices(sel)
+        atoms.extend(sel)
+        starts.append(len(atoms))
+    if positions is None:
+        x = _np.empty(natom * 3)
+        _pys.get_positions(x)
+    else:
+        if u.is_quantity(positions):
+            positions = positions.value_in_unit(u.angstroms)
+        x = _np.array(positions, dtype=_np.float64).ravel()
+    if seed is None:
+        seed = int(_np.frombuffer(_os.urandom(8), dtype=_np.uint64)[0])
+    if trajectory is not None:
+        frames = _np.lib.format.open_memmap(trajectory, mode='w+',
+                        dtype=_np.float64, shape=(nframes, natom, 3))
+    else:
+        frames = _np.empty((nframes, natom, 3))
+    energies = _np.empty((nframes, len(ENERGY_TERMS)))
+    have_frames = nframes > 0
+    ene, nframes, attempted, accepted = _pys.monte_carlo(
+            x, _np.array(types, dtype=_np.intp),
+            _np.array(sizes, dtype=_np.float64),
+            _np.array(axes, dtype=_np.intp), _np.array(starts, dtype=_np.intp),
+            _np.array(atoms, dtype=_np.intp), nsteps, temperature, seed,
+            nwrite, frames if have_frames else None,
+            energies if have_frames else None)
+    if trajectory is not None:
+        frames.flush()
+    attempted = _np.array(attempted)
+    accepted = _np.array(accepted)
+    with _np.errstate(invalid='ignore', divide='ignore'):
+        acceptance = accepted / attempted.astype(_np.float64)
+    if APPLY_UNITS:
+        ene = _apply_units_to_struct(ene, u.kilocalories_per_mole)
+    return MonteCarloResult(x.reshape((natom, 3)), frames, energies, attempted,
+                            accepted, acceptance, ene)
+
+# The number of atom groups registered by set_groups, and the setup_count of
+# the system they belong to
+_GROUPS = dict(count=None, ngroups=0)
+
+def _molecule_numbers(parm, natom):
+    """
+    Returns the 1-based molecule of every atom, found as the connected
+    components of the bond graph and numbered in the order of their first atoms
+    """
+    parent = list(range(natom))
+    def root(i):
+        while parent[i] != i:
+            parent[i] = i = parent[parent[i]]
+        return i
+    for key in ('BONDS_INC_HYDROGEN', 'BONDS_WITHOUT_HYDROGEN'):
+        bonds = parm.parm_data.get(key, ())
+        # (i, j, type) triples, where i and j are 3 times the atom indices
+        for k in range(0, len(bonds) - 2, 3):
+            a, b = root(bonds[k] // 3), root(bonds[k+1] // 3)
+            if a != b:
+                # Keep the lowest atom as the root of every molecule
+                parent[max(a, b)] = min(a, b)
+    numbers = _np.empty(natom, dtype=_np.intp)
+    molecule = dict()
+    for i in range(natom):
+        numbers[i] = molecule.setdefault(root(i), len(molecule) + 1)
+    return numbers
+
+def _group_numbers(groups, natom):
+    """ Converts the groups accepted by set_groups into 1-based group numbers """
+    if isinstance(groups, string_types):
+        parm = _active_parm()
+        if groups == 'residues':
+            sizes = _np.diff(_np.append(parm.parm_data['RESIDUE_POINTER'],
+                                        natom + 1))
+        elif groups == 'molecules':
+            if 'ATOMS_PER_MOLECULE' not in parm.parm_data:
+                # Only periodic topologies list the molecules
+                return _molecule_numbers(parm, natom)
+            sizes = parm.parm_data['ATOMS_PER_MOLECULE']
+        else:
+            raise ValueError("groups must be 'residues' or 'molecules' if it "
+                             "is a string")
+        return _np.repeat(_np.arange(1, len(sizes) + 1, dtype=_np.intp), sizes)
+    if isinstance(groups, _np.ndarray) and groups.ndim == 1 and \
+            groups.dtype.kind == 'i':
+        # Per-atom 0-based group indices; negative for atoms in no group
+        return _np.ascontiguousarray(_np.maximum(groups + 1, 0), dtype=_np.intp)
+    numbers = _np.zeros(natom, dtype=_np.intp)
+    for i, group in enumerate(groups):
+        numbers[_atom_indices(group)] = i + 1
+    return numbers
+
+def set_groups(groups, masses=None):
+    """
+    Registers atom groups of the active system for energy_forces_groups. The
+    groups stay registered until set_groups is called again or the system is
+    cleaned up.
+
+    Parameters
+    ----------
+    groups : str, array of int, or list
+        'residues' or 'molecules' to group atoms by the topology the active
+        system was set up with (molecules of non-periodic topologies are found
+        from the bonds); a natom-length integer array with the 0-based
+        group of every atom (negative for atoms in no group); or a list of
+        groups, each an Amber mask or a list of atom indices
+    masses : array of float, optional
+        The atomic masses in amu used for the centers of mass. By default, they
+        are taken from the topology the active system was set up with
+
+    Returns
+    -------
+    ngroups : int
+        The number of groups registered
+    """
+    natom = _pys.natom()
+    numbers = _group_numbers(groups, natom)
+    if masses is None:
+        masses = _active_parm().parm_data['MASS']
+    masses = _np.ascontiguousarray(masses, dtype=_np.float64)
+    ngroups = _pys.set_groups(numbers, masses)
+    _GROUPS.update(count=_pys.setup_count(), ngroups=ngroups)
+    return ngroups
+
+def energy_forces_groups(com=False):
+    """
+    Computes the energies and the net force and torque on every group registered
+    with set_groups. The forces are reduced inside the extension module in one
+    pass, so the per-atom forces are never copied out of it.
+
+    Parameters
+    ----------
+    com : bool, optional
+        If True, the centers of mass of the groups are returned as well
+
+    Returns
+    -------
+    energy, forces, torques, com : EnergyTerms, np.ndarray, np.ndarray, np.ndarray
+        The energies, the (ngroups, 3) net forces in kcal/mol/Angstrom and
+        torques about the group centers of mass in kcal/mol, and the (ngroups,
+        3) centers of mass in Angstroms (or None if not requested)
+    """
+    if _GROUPS['count'] != _pys.setup_count():
+        raise RuntimeError('No groups are registered for the active system')
+    ngroups = _GROUPS['ngroups']
+    forces = _np.empty((ngroups, 3))
+    torques = _np.empty((ngroups, 3))
+    centers = _np.empty((ngroups, 3)) if com else None
+    e = _pys.energy_forces_groups(forces, torques, centers)
+    if APPLY_UNITS:
+        return (_apply_units_to_struct(e, u.kilocalories_per_mole),
+                u.Quantity(forces, u.kilocalories_per_mole/u.angstroms),
+                u.Quantity(torques, u.kilocalories_per_mole),
+                None if centers is None else u.Quantity(centers, u.angstroms))
+    return e, forces, torques, centers
+
 def set_box(a, b, c, alpha, beta, gamma):
     """ Sets the unit cell dimensions for the current system
 
@@ -190,6 +1035,29 @@ def get_box():
                 alpha*u.degrees, beta*u.degrees, gamma*u.degrees)
     return (a, b, c, alpha, beta, gamma)
 
+def _read_coordinates(coordinates, box):
+    """
+    Converts the coordinates and box passed to setup into contiguous float64
+    arrays that sander can read in place
+    """
+    # Handle the case where the coordinates are actually a restart file
+    if isinstance(coordinates, string_types):
+        # This is a restart file name. Parse it and make sure the coordinates
+        # and box
+        rst = Rst7.open(coordinates)
+        coordinates = rst.coordinates
+        if rst.hasbox and (box is None or box is False):
+            box = rst.box
+
+    coordinates = _np.ascontiguousarray(coordinates, dtype=_np.float64)
+    if box is None or box is False:
+        box = _np.zeros(6)
+    else:
+        box = _np.array([float(x) for x in box])
+    if box.shape != (6,):
+        raise ValueError('box must have 6 elements')
+    return coordinates, box
+
 # Use a class instead of a function to work like a context manager. For all
 # intents and purposes, it behaves exactly like a function would
 class setup(object):
@@ -213,6 +1081,14 @@ class setup(object):
     qm_options : QmInputOptions (optional)
         struct with the QM options in sander QM/MM calculations
 
+    Notes
+    -----
+    An AmberParm is handed to sander by writing it with its write_parm method,
+    which may update the AmberParm itself (e.g., rebuild its parm_data from its
+    atoms). It is only written the first time that AmberParm object is set up,
+    and later setups reuse the file, so changes made to it afterwards are not
+    seen. Set up a copy of a topology you have modified instead.
+
     Examples
     --------
 
@@ -250,31 +1126,12 @@ class setup(object):
     """
 
     def __init__(self, prmtop, coordinates, box, mm_options, qm_options=None):
-        # Handle the case where the coordinates are actually a restart file
-        if isinstance(coordinates, string_types):
-            # This is a restart file name. Parse it and make sure the coordinates
-            # and box
-            rst = Rst7.open(coordinates)
-            coordinates = rst.coordinates
-            if rst.hasbox and (box is None or box is False):
-                box = rst.box
-
-        # Convert from numpy arrays to regular arrays
-        coordinates = _np.array(coordinates, copy=False, subok=True)
-        coordinates = coordinates.flatten().tolist()
-        if box is None or box is False:
-            box = _np.zeros(6)
-        else:
-            box = _np.array([float(x) for x in box])
-        if box.shape != (6,):
-            raise ValueError('box must have 6 elements')
-        box = box.tolist()
+        coordinates, box = _read_coordinates(coordinates, box)
 
-        # Check if the prmtop is an AmberParm instance or not. If it is, write out a
-        # temporary prmtop file
+        # Check if the prmtop is an AmberParm instance or not. If it is, hand it
+        # to sander through an in-memory file
         if isinstance(prmtop, AmberParm):
-            parm = tempfile.mktemp(suffix='.parm7')
-            prmtop.write_parm(parm)
+            parm = _prmtop_path(prmtop)
         elif not isinstance(prmtop, string_types):
             raise TypeError('prmtop must be an AmberParm or string')
         else:
@@ -289,6 +1146,7 @@ class setup(object):
             _pys.setup(parm, coordinates, box, mm_options)
         else:
             _pys.setup(parm, coordinates, box, mm_options, qm_options)
+        _set_active_prmtop(prmtop, mm_options, qm_options)
 
     def __enter__(self):
         """ Nothing needs to be done here """
@@ -319,16 +1177,22 @@ class setup(object):
     def box(self, value):
         set_box(*value)
 
-    def energy_forces(self):
+    def energy_forces(self, out=None):
         """ Computes the energy and forces for the loaded context
 
+        Parameters
+        ----------
+        out : np.ndarray, optional
+            C-contiguous float64 array of shape (natom, 3) that the forces are
+            written into. Reusing it avoids allocating a new array every step
+
         Returns
         -------
         ene, frc : EnergyTerms, np.ndarray
             ene is the struct of energies and frc is a numpy array of shape
             (natom, 3) with all atomic forces in kcal/mol/A
         """
-        ene, frc = energy_forces(as_numpy=True)
+        ene, frc = energy_forces(as_numpy=True, out=out)
         return ene, frc.reshape((self.natom, 3))
 
     # A sander context is True IFF a system is set up. Otherwise it evaluates to
@@ -347,3 +1211,96 @@ class setup(object):
             return '<SANDER Context; natom=%d; box=%s>' % (self.natom, self.box)
         else:
             return '<SANDER Context; natom=%d; no PBC>' % self.natom
+
+
+class Session(object):
+    """
+    Sets up sander calculations, reusing the active system whenever possible.
+    If setup is called with the same topology and input options as the system
+    that is already set up, only the coordinates and box are updated and the
+    expensive sander cleanup/setup cycle is skipped. Otherwise, the active
+    system is cleaned up and the new one is set up.
+
+    The prmtop is identified by its path, size and modification time when it is
+    a file name. An AmberParm is identified by a hash of the prmtop it was
+    written to the first time that object was set up (see setup), so it is not
+    written or hashed again by later calls and must not be modified in between.
+
+    Examples
+    --------
+    >>> with sander.Session() as session:
+    ...     for coords in structures:
+    ...         session.setup("prmtop", coords, None, mm_options)
+    ...         e, f = sander.energy_forces()
+    ...     print(session.hits, session.misses)
+
+    Attributes
+    ----------
+    hits : int
+        Number of setup calls that reused the active system
+    misses : int
+        Number of setup calls that had to set up a new system
+    """
+
+    def __init__(self):
+        self.hits = 0
+        self.misses = 0
+        self._fingerprint = None
+        self._setup_count = None
+
+    @staticmethod
+    def _prmtop_fingerprint(prmtop):
+        if isinstance(prmtop, AmberParm):
+            return _parm_key(prmtop)
+        if not isinstance(prmtop, string_types):
+            raise TypeError('prmtop must be an AmberParm or string')
+        st = _os.stat(prmtop)
+        return (_os.path.abspath(prmtop), st.st_size, st.st_mtime)
+
+    def setup(self, prmtop, coordinates, box, mm_options, qm_options=None):
+        """
+        Sets up the system, reusing the active one if possible. Takes the same
+        arguments as sander.setup and returns this Session
+        """
+        coordinates, box = _read_coordinates(coordinates, box)
+        fingerprint = (self._prmtop_fingerprint(prmtop),
+                       _struct_to_dict(mm_options), _struct_to_dict(qm_options))
+        if (fingerprint == self._fingerprint and _pys.is_setup() and
+                _pys.setup_count() == self._setup_count and
+                coordinates.size == 3 * _pys.natom()):
+            self.hits += 1
+            _pys.set_positions(coordinates)
+            if box.any():
+                _pys.set_box(*box)
+            return self
+        self.misses += 1
+        self._fingerprint = None
+        if _pys.is_setup():
+            _pys.cleanup()
+        setup(prmtop, coordinates, box, mm_options, qm_options)
+        self._fingerprint = fingerprint
+        self._setup_count = _pys.setup_count()
+        return self
+
+    @property
+    def stats(self):
+        """ A dict with the number of setup hits and misses """
+        return dict(hits=self.hits, misses=self.misses)
+
+    def close(self):
+        """ Cleans up the system this Session set up, if it is still active """
+        if (self._fingerprint is not None and _pys.is_setup() and
+                _pys.setup_count() == self._setup_count):
+            _pys.cleanup()
+        self._fingerprint = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args, **kwargs):
+        self.close()
+
+from .pool import Pool, _struct_to_dict, _struct_from_dict
+from .hessian import hessian, HessianResult
+from .asynchronous import Evaluator, evaluate_async, energy_forces_async
+from .dataset import DatasetWriter, DatasetReader
@@ -0,0 +1,229 @@
+"""
+Asynchronous evaluation of the active system.
+
+Calls such as sander.energy_forces block the calling thread for the whole
+evaluation, which stalls an asyncio event loop. The functions here hand the
+work to a dedicated evaluation thread instead and immediately return a
+concurrent.futures.Future; from a coroutine, wrap it with asyncio.wrap_future
+and await it::
+
+    >>> ene, frc = await asyncio.wrap_future(sander.evaluate_async(x))
+
+The evaluation thread spends its time inside the extension module, which
+releases the GIL, so the event loop keeps running. Requests that queue up while
+it is busy are coalesced and evaluated with a single energy_forces_batch call,
+so many coroutines can share the one sander system efficiently.
+"""
+from __future__ import print_function, division, absolute_import
+
+import threading
+import numpy as _np
+from parmed import unit as u
+try:
+    import queue as _queue
+except ImportError:
+    import Queue as _queue
+try:
+    from concurrent.futures import Future
+except ImportError:
+    # Python 2 without the futures backport
+    Future = None
+
+__all__ = ['Evaluator', 'evaluate_async', 'energy_forces_async']
+
+class _Request(object):
+    """ One structure to evaluate and the Future its result goes to """
+    __slots__ = ('positions', 'box', 'forces', 'future')
+
+    def __init__(self, positions, box, forces):
+        self.positions = positions
+        self.box = box
+        self.forces = forces
+        self.future = Future()
+
+class Evaluator(object):
+    """
+    Evaluates structures of the active system on a background thread. Requests
+    are queued in submission order; whatever has queued up when the thread
+    becomes free is evaluated in one batch of at most max_batch structures.
+
+    When a batch finishes, its last structure (and box) is left as the active
+    conformation, as with sander.energy_forces_batch. The system must stay set
+    up while requests are pending; requests evaluated after cleanup fail with
+    the RuntimeError sander raises.
+
+    Parameters
+    ----------
+    max_batch : int, optional
+        The largest number of requests evaluated in one batch
+    """
+
+    def __init__(self, max_batch=64):
+        if Future is None:
+            raise ImportError('asynchronous evaluation requires the '
+                              'concurrent.futures module')
+        if max_batch < 1:
+            raise ValueError('max_batch must be at least 1')
+        self.max_batch = max_batch
+        self._queue = _queue.Queue()
+        # Guards _closed, so no request is queued behind the stop sentinel
+        self._lock = threading.Lock()
+        self._closed = False
+        self._thread = threading.Thread(target=self._run,
+                                        name='sander-evaluator')
+        self._thread.daemon = True
+        self._thread.start()
+
+    def submit(self, positions, box=None, forces=True):
+        """
+        Queues the evaluation of one structure
+
+        Parameters
+        ----------
+        positions : array of float
+            The natom*3 atomic positions. They are copied, so the caller can
+            reuse the array right away. They can have units of length
+        box : list/iterable of 6 floats, optional
+            The unit cell (a, b, c, alpha, beta, gamma). Default is the box of
+            the active system when the request is evaluated
+        forces : bool, optional
+            If False, the forces are not returned
+
+        Returns
+        -------
+        future : concurrent.futures.Future
+            Resolves to (energy, forces) with an EnergyTerms and a natom*3
+            numpy array (or None if forces were not requested), like
+            sander.energy_forces(as_numpy=True)
+        """
+        from . import _pys
+        if u.is_quantity(positions):
+            positions = positions.value_in_unit(u.angstroms)
+        positions = _np.array(positions, dtype=_np.float64).ravel()
+        if positions.size != 3 * _pys.natom():
+            raise ValueError('positions must have %d elements' %
+                             (3 * _pys.natom()))
+        if box is not None:
+            box = _np.array([x.value_in_unit(u.angstroms if i < 3 else
+                             u.degrees) if u.is_quantity(x) else float(x)
+                             for i, x in enumerate(box)])
+            if box.shape != (6,):
+                raise ValueError('box must have 6 elements')
+        request = _Request(positions, box, forces)
+        with self._lock:
+            if self._closed:
+                raise RuntimeError('Evaluator is closed')
+            self._queue.put(request)
+        return request.future
+
+    def close(self, wait=True):
+        """
+        Stops the evaluation thread once the queued requests are done
+
+        Parameters
+        ----------
+        wait : bool, optional
+            If True (default), block until the thread has finished
+        """
+        with self._lock:
+            if not self._closed:
+                self._closed = True
+                self._queue.put(None)
+        if wait:
+            self._thread.join()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args, **kwargs):
+        self.close()
+
+    def _run(self):
+        stop = False
+        while not stop:
+            request = self._queue.get()
+            if request is None:
+                break
+            batch = [request]
+            while len(batch) < self.max_batch:
+                try:
+                    request = self._queue.get_nowait()
+                except _queue.Empty:
+                    break
+                if request is None:
+                    stop = True
+                    break
+                batch.append(request)
+            batch = [r for r in batch if r.future.set_running_or_notify_cancel()]
+            if batch:
+                self._evaluate(batch)
+
+    def _evaluate(self, batch):
+        from . import _pys, ENERGY_TERMS, EnergyTerms, APPLY_UNITS
+        try:
+            natom = _pys.natom()
+            frames = _np.empty((len(batch), 3 * natom))
+            for i, request in enumerate(batch):
+                frames[i] = request.positions
+            boxes = None
+            if any(request.box is not None for request in batch):
+                boxes = _np.empty((len(batch), 6))
+                boxes[:] = _pys.get_box()
+                for i, request in enumerate(batch):
+                    if request.box is not None:
+                        boxes[i] = request.box
+            ene = _np.empty((len(batch), len(ENERGY_TERMS)))
+            need_forces = any(request.forces for request in batch)
+            frc = _np.empty((len(batch), 3 * natom)) if need_forces else None
+            _pys.energy_forces_batch(frames, boxes, ene, frc)
+        except Exception as err:
+            for request in batch:
+                request.future.set_exception(err)
+            return
+        # A failure here must not kill the evaluation thread, which would leave
+        # every later request pending forever
+        for i, request in enumerate(batch):
+            try:
+                e = EnergyTerms()
+                _np.asarray(e)[:] = ene[i]
+                f = frc[i] if request.forces else None
+                if APPLY_UNITS:
+                    from . import _apply_units_to_struct
+                    e = _apply_units_to_struct(e, u.kilocalories_per_mole)
+                    if f is not None:
+                        f = u.Quantity(f, u.kilocalories_per_mole/u.angstroms)
+            except Exception as err:
+                request.future.set_exception(err)
+            else:
+                request.future.set_result((e, f))
+
+# The Evaluator used by evaluate_async and energy_forces_async, started on
+# first use
+_DEFAULT = dict(evaluator=None)
+_DEFAULT_LOCK = threading.Lock()
+
+def _default_evaluator():
+    with _DEFAULT_LOCK:
+        if _DEFAULT['evaluator'] is None:
+            _DEFAULT['evaluator'] = Evaluator()
+        return _DEFAULT['evaluator']
+
+def evaluate_async(positions, box=None, forces=True):
+    """
+    Queues the evaluation of the energies and forces of a structure on the
+    shared evaluation thread and returns a concurrent.futures.Future. See
+    Evaluator.submit for the arguments and the result
+    """
+    return _default_evaluator().submit(positions, box, forces)
+
+def energy_forces_async(forces=True):
+    """
+    Queues the evaluation of the energies and forces of the active structure
+    (as it is when this is called) on the shared evaluation thread and returns
+    a concurrent.futures.Future resolving to (energy, forces). See
+    Evaluator.submit
+    """
+    from . import _pys
+    positions = _np.empty(3 * _pys.natom())
+    _pys.get_positions(positions)
+    return _default_evaluator().submit(positions, None, forces)
@@ -0,0 +1,403 @@
+"""
+Sharded, optionally compressed storage of energies, forces and positions, e.g.,
+for generating machine-learning training data from millions of conformers.
+
+A DatasetWriter appends batches of frames to shard files in a directory,
+starting a new shard whenever the current one would grow past a size limit, and
+keeps an index of all shards in index.json. Encoding, compression and disk I/O
+happen on a background thread, so they overlap with the evaluation of the next
+batch (sander, zlib and lzma all release the GIL while they work)::
+
+    >>> with sander.DatasetWriter('data', dtype=np.float32,
+    ...                           compression='zlib') as writer:
+    ...     for frames in conformer_batches:
+    ...         writer.evaluate(frames)
+    >>> data = sander.DatasetReader('data').load()
+
+Shard layout
+------------
+Every shard starts with a 24-byte header (all little-endian)::
+
+    4s  magic (b'PSDS')
+    B   format version
+    B   bytes per force/position value (4 or 8)
+    B   compression (0 none, 1 zlib, 2 lzma)
+    B   flags (1: forces are stored, 2: positions are stored)
+    I   number of atoms
+    H   number of energy terms
+    H   reserved (0)
+    Q   number of frames in the shard
+
+followed by blocks, one per appended batch. Each block is a 20-byte header
+(uint32 frames, uint64 raw bytes, uint64 stored bytes) and the (compressed)
+payload: the energy terms as float64 (frames, nterms), then the forces and the
+positions (frames, natom, 3) if stored. The energy terms are in the order of
+sander.ENERGY_TERMS, which the index records as well.
+"""
+from __future__ import print_function, division, absolute_import
+
+import json
+import os
+import struct
+import threading
+import zlib
+import numpy as _np
+try:
+    import lzma as _lzma
+except ImportError:
+    _lzma = None
+try:
+    import queue as _queue
+except ImportError:
+    import Queue as _queue
+
+__all__ = ['DatasetWriter', 'DatasetReader']
+
+MAGIC = b'PSDS'
+VERSION = 1
+_HEADER = struct.Struct('<4sBBBBIHHQ')
+_BLOCK = struct.Struct('<IQQ')
+
+FLAG_FORCES = 1
+FLAG_POSITIONS = 2
+
+_COMPRESSION = {None: 0, 'zlib': 1, 'lzma': 2}
+_INDEX = 'index.json'
+
+def _compress(data, method, level):
+    if method == 1:
+        return zlib.compress(data, level)
+    if method == 2:
+        return _lzma.compress(data, preset=level)
+    return data
+
+def _decompress(data, method):
+    if method == 1:
+        return zlib.decompress(data)
+    if method == 2:
+        return _lzma.decompress(data)
+    return data
+
+def _replace(src, dst):
+    """ Atomically renames src to dst, replacing it if it exists """
+    try:
+        os.replace(src, dst)
+    except AttributeError:
+        # Python 2
+        if os.path.exists(dst):
+            os.remove(dst)
+        os.rename(src, dst)
+
+class DatasetWriter(object):
+    """
+    Writes energies, forces and positions to size-bounded shard files
+
+    Parameters
+    ----------
+    directory : str
+        Where the shards and the index are written. It is created if needed,
+        and must not already hold a dataset
+    natom : int, optional
+        The number of atoms. Default is that of the active system
+    dtype : np.float32 or np.float64, optional
+        The precision the forces and positions are stored in. Energies are
+        always stored as float64
+    compression : None, 'zlib' or 'lzma', optional
+        Lossless compression of every block
+    level : int, optional
+        The compression level (default 6 for zlib and lzma)
+    forces, positions : bool, optional
+        Whether forces and positions are stored (default both)
+    max_shard_bytes : int, optional
+        A new shard is started when appending a block would make the current
+        one larger than this (a single block larger than this still gets a
+        shard of its own)
+    queue_size : int, optional
+        The number of batches that may be waiting for the writer thread before
+        append blocks
+    """
+
+    def __init__(self, directory, natom=None, dtype=_np.float64,
+                 compression=None, level=6, forces=True, positions=True,
+                 max_shard_bytes=256*1024*1024, queue_size=2):
+        from . import ENERGY_TERMS, _pys
+        if compression not in _COMPRESSION:
+            raise ValueError("compression must be None, 'zlib' or 'lzma'")
+        if compression == 'lzma' and _lzma is None:
+            raise ValueError('lzma compression is not available')
+        self.dtype = _np.dtype(dtype)
+        if self.dtype not in (_np.dtype(_np.float32), _np.dtype(_np.float64)):
+            raise ValueError('dtype must be float32 or float64')
+        if natom is None:
+            natom = _pys.natom()
+        if not os.path.isdir(directory):
+            os.makedirs(directory)
+        if os.path.exists(os.path.join(directory, _INDEX)):
+            raise IOError('%s already holds a dataset' % directory)
+        self.directory = directory
+        self.natom = natom
+        self.terms = list(ENERGY_TERMS)
+        self.compression = compression
+        self.level = level
+        self.forces = forces
+        self.positions = positions
+        self.max_shard_bytes = max_shard_bytes
+        self.nframes = 0
+        self._method = _COMPRESSION[compression]
+        self._flags = (FLAG_FORCES if forces else 0) | \
+                      (FLAG_POSITIONS if positions else 0)
+        self._shards = []
+        self._file = None
+        self._error = None
+        self._closed = False
+        self._queue = _queue.Queue(maxsize=queue_size)
+        self._thread = threading.Thread(target=self._run,
+                                        name='sander-dataset-writer')
+        self._thread.daemon = True
+        self._thread.start()
+
+    def _check(self):
+        if self._error is not None:
+            raise self._error
+        if self._closed:
+            raise RuntimeError('DatasetWriter is closed')
+
+    def _owned(self, arr, dtype, shape, name, copy):
+        """
+        Returns arr as a C-contiguous array of dtype that the caller cannot
+        modify anymore while it waits in the queue
+        """
+        if arr is None:
+            raise ValueError('%s must be given for this dataset' % name)
+        if copy:
+            out = _np.array(arr, dtype=dtype, order='C')
+        else:
+            out = _np.ascontiguousarray(arr, dtype=dtype)
+        if out.size != _np.prod(shape):
+            raise ValueError('%s must have %d elements' %
+                             (name, _np.prod(shape)))
+        return out.reshape(shape)
+
+    def append(self, energies, forces=None, positions=None, copy=True):
+        """
+        Queues a batch of frames for writing
+
+        Parameters
+        ----------
+        energies : array of float or EnergyTerms
+            The energy terms of every frame with shape (nframes, nterms) in
+            the order of sander.ENERGY_TERMS (as returned by
+            energy_forces_batch), or a single EnergyTerms
+        forces, positions : array of float, optional
+            The forces and positions of every frame, (nframes, natom, 3).
+            Required if the dataset stores them
+        copy : bool, optional
+            If False, arrays that already have the stored type are handed to
+            the writer thread without a copy, so they must not be modified
+            afterwards
+        """
+        self._check()
+        energies = _np.asarray(energies, dtype=_np.float64)
+        nframes = energies.size // len(self.terms)
+        energies = self._owned(energies, _np.float64,
+                               (nframes, len(self.terms)), 'energies', copy)
+        shape = (nframes, self.natom, 3)
+        if self.forces:
+            forces = self._owned(forces, self.dtype, shape, 'forces', copy)
+        if self.positions:
+            positions = self._owned(positions, self.dtype, shape, 'positions',
+                                    copy)
+        self.nframes += nframes
+        self._queue.put((energies, forces if self.forces else None,
+                         positions if self.positions else None))
+
+    def evaluate(self, frames, boxes=None):
+        """
+        Evaluates a batch of frames with sander.energy_forces_batch and queues
+        the results for writing. The writer thread stores them while the next
+        batch is evaluated
+
+        Parameters
+        ----------
+        frames : array of float
+            The positions of every frame, (nframes, natom, 3). They are copied,
+            so the same array can be refilled for the next batch right away
+        boxes : array of float, optional
+            The unit cell of every frame, (nframes, 6)
+
+        Returns
+        -------
+        energies, forces : np.ndarray, np.ndarray or None
+            As returned by sander.energy_forces_batch. These arrays are queued
+            for writing without a copy, so they must not be modified in place
+        """
+        from . import _pys
+        self._check()
+        frames = _np.ascontiguousarray(frames, dtype=_np.float64)
+        nframes = frames.size // (3 * self.natom)
+        if boxes is not None:
+            boxes = _np.ascontiguousarray(boxes, dtype=_np.float64)
+        ene = _np.empty((nframes, len(self.terms)))
+        frc = _np.empty((nframes, self.natom, 3)) if self.forces else None
+        _pys.energy_forces_batch(frames, boxes, ene, frc)
+        if self.positions:
+            # ene and frc are ours, but the caller may reuse frames while this
+            # batch waits in the queue
+            frames = _np.array(frames, dtype=self.dtype)
+        self.append(ene, frc, frames, copy=False)
+        return ene, frc
+
+    def close(self):
+        """ Writes all queued batches, finishes the last shard and the index """
+        if not self._closed:
+            self._closed = True
+            self._queue.put(None)
+            self._thread.join()
+        if self._error is not None:
+            raise self._error
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args, **kwargs):
+        self.close()
+
+    # The rest runs on the writer thread
+
+    def _run(self):
+        while True:
+            item = self._queue.get()
+            if item is None:
+                break
+            if self._error is not None:
+                continue
+            try:
+                self._write_block(*item)
+            except Exception as err:
+                self._error = err
+        try:
+            self._finish_shard()
+            self._write_index()
+        except Exception as err:
+            if self._error is None:
+                self._error = err
+
+    def _write_block(self, energies, forces, positions):
+        arrays = [a for a in (energies, forces, positions) if a is not None]
+        raw = b''.join(a.tobytes() for a in arrays)
+        data = _compress(raw, self._method, self.level)
+        size = _BLOCK.size + len(data)
+        shard = self._shards[-1] if self._shards else None
+        if self._file is None or (shard['blocks'] and
+                                  shard['bytes'] + size > self.max_shard_bytes):
+            self._start_shard()
+            shard = self._shards[-1]
+        nframes = energies.shape[0]
+        shard['blocks'].append([shard['bytes'], nframes])
+        self._file.write(_BLOCK.pack(nframes, len(raw), len(data)))
+        self._file.write(data)
+        shard['bytes'] += size
+        shard['nframes'] += nframes
+
+    def _header(self, nframes):
+        return _HEADER.pack(MAGIC, VERSION, self.dtype.itemsize, self._method,
+                            self._flags, self.natom, len(self.terms), 0,
+                            nframes)
+
+    def _start_shard(self):
+        self._finish_shard()
+        name = 'shard-%05d.psd' % len(self._shards)
+        self._file = open(os.path.join(self.directory, name), 'wb')
+        self._file.write(self._header(0))
+        self._shards.append(dict(file=name, nframes=0, bytes=_HEADER.size,
+                                 blocks=[]))
+
+    def _finish_shard(self):
+        if self._file is None:
+            return
+        # Fill in the number of frames, then record the shard in the index
+        self._file.seek(0)
+        self._file.write(self._header(self._shards[-1]['nframes']))
+        self._file.close()
+        self._file = None
+        self._write_index()
+
+    def _write_index(self):
+        index = dict(version=VERSION, natom=self.natom, terms=self.terms,
+                     dtype=self.dtype.name, compression=self.compression,
+                     forces=self.forces, positions=self.positions,
+                     nframes=sum(s['nframes'] for s in self._shards),
+                     shards=self._shards)
+        fname = os.path.join(self.directory, _INDEX)
+        with open(fname + '.tmp', 'w') as f:
+            json.dump(index, f, indent=1)
+        _replace(fname + '.tmp', fname)
+
+class DatasetReader(object):
+    """
+    Reads a dataset written by DatasetWriter
+
+    Parameters
+    ----------
+    directory : str
+        The directory holding index.json and the shards
+    """
+
+    def __init__(self, directory):
+        self.directory = directory
+        with open(os.path.join(directory, _INDEX)) as f:
+            self.index = json.load(f)
+        self.natom = self.index['natom']
+        self.terms = self.index['terms']
+        self.dtype = _np.dtype(self.index['dtype'])
+        self.nframes = self.index['nframes']
+
+    def __len__(self):
+        return self.nframes
+
+    def iter_blocks(self):
+        """
+        Yields the blocks in the order they were written, each as a dict with
+        energies and, if stored, forces and positions
+        """
+        nterms = len(self.terms)
+        for shard in self.index['shards']:
+            with open(os.path.join(self.directory, shard['file']), 'rb') as f:
+                magic, version, itemsize, method, flags, natom, nt, _, _ = \
+                        _HEADER.unpack(f.read(_HEADER.size))
+                if magic != MAGIC or version != VERSION:
+                    raise IOError('%s is not a dataset shard' % shard['file'])
+                dtype = _np.float32 if itemsize == 4 else _np.float64
+                for offset, _ in shard['blocks']:
+                    f.seek(offset)
+                    nframes, _, stored = _BLOCK.unpack(f.read(_BLOCK.size))
+                    raw = _decompress(f.read(stored), method)
+                    block = dict()
+                    off = 8 * nframes * nterms
+                    block['energies'] = _np.frombuffer(raw, _np.float64,
+                            nframes * nterms).reshape((nframes, nterms))
+                    for name, flag in (('forces', FLAG_FORCES),
+                                       ('positions', FLAG_POSITIONS)):
+                        if flags & flag:
+                            n = nframes * natom * 3
+                            block[name] = _np.frombuffer(raw, dtype, n, off
+                                    ).reshape((nframes, natom, 3))
+                            off += n * itemsize
+                    yield block
+
+    def load(self):
+        """
+        Reads the whole dataset into memory
+
+        Returns
+        -------
+        data : dict
+            energies (nframes, nterms) and, if stored, forces and positions
+            (nframes, natom, 3)
+        """
+        blocks = list(self.iter_blocks())
+        data = dict(energies=_np.empty((0, len(self.terms))))
+        if blocks:
+            for name in blocks[0]:
+                data[name] = _np.concatenate([b[name] for b in blocks])
+        return data
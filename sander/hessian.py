@@ -0,0 +1,176 @@
+"""
+Finite-difference Hessians and normal modes computed in parallel.
+
+Every Cartesian coordinate (of all atoms, or of a subset) is displaced by +h and
+-h, and the central differences of the forces give one row of the Hessian. The
+2N displaced structures are independent, so they are generated lazily in chunks
+and evaluated by a Pool of worker processes that each hold their own sander
+setup. By default, the workers recreate the active system (the one passed to
+setup), and the Hessian is computed at its current positions.
+"""
+from __future__ import print_function, division, absolute_import
+
+from collections import namedtuple as _namedtuple
+import numpy as _np
+from parmed.amber import AmberParm
+
+__all__ = ['hessian', 'HessianResult']
+
+# sqrt(kcal/mol/A^2/amu) -> wavenumbers (1/cm): sqrt(418.4 ps^-2) / (2 pi c)
+_TO_WAVENUMBERS = _np.sqrt(418.4) / (2 * _np.pi * 2.99792458e-2)
+
+HessianResult = _namedtuple('HessianResult', 'hessian atoms frequencies modes')
+HessianResult.__doc__ = """
+The outcome of hessian
+
+Attributes
+----------
+hessian : np.ndarray (3*natom_sel, 3*natom_sel)
+    The symmetrized Hessian in kcal/mol/Angstrom^2, with the coordinates
+    ordered x, y, z of each selected atom
+atoms : np.ndarray of int
+    The indices of the selected atoms
+frequencies : np.ndarray or None
+    Normal-mode frequencies in 1/cm, in ascending order (imaginary
+    frequencies are reported as negative numbers)
+modes : np.ndarray or None
+    The mass-weighted normal modes as columns, matching frequencies
+"""
+
+def _displacements(x0, coords, step, per_chunk):
+    """ Yields chunks of structures displaced by +step and -step """
+    natom = x0.shape[0]
+    for start in range(0, len(coords), per_chunk):
+        block = coords[start:start+per_chunk]
+        frames = _np.empty((2 * len(block), natom, 3))
+        frames[:] = x0
+        for i, k in enumerate(block):
+            frames[2*i, k // 3, k % 3] += step
+            frames[2*i+1, k // 3, k % 3] -= step
+        yield frames
+
+def hessian(prmtop=None, coordinates=None, mm_options=None, step=1e-3,
+            atoms=None, modes=False, masses=None, nworkers=None,
+            qm_options=None, box=None, pool=None):
+    """
+    Computes the Hessian of a structure by central finite differences of the
+    forces, evaluating the displaced structures in parallel
+
+    Parameters
+    ----------
+    prmtop : AmberParm or str, optional
+        The topology, as passed to setup. Default is the topology of the
+        active system, along with its mm_options and qm_options
+    coordinates : array of float or str, optional
+        The structure (natom, 3) whose Hessian is computed, or an inpcrd file.
+        Default is the current positions (and box) of the active system.
+        Required if pool is given
+    mm_options : InputOptions, optional
+        struct with sander options. Required if prmtop is given
+    step : float, optional
+        The displacement of each coordinate in Angstroms
+    atoms : iterable of int, optional
+        Indices of the atoms whose coordinates are displaced. The Hessian is
+        restricted to this subset (default all atoms)
+    modes : bool, optional
+        If True, diagonalize the mass-weighted Hessian to obtain normal modes
+    masses : array of float, optional
+        Atomic masses (amu) used for the normal modes. Taken from the topology
+        if not given; required for modes if pool is given. All selected atoms
+        must have a positive mass, so massless extra points have to be left
+        out with atoms
+    nworkers : int, optional
+        Number of worker processes (default is the number of CPUs)
+    qm_options : QmInputOptions, optional
+        struct with the QM options in sander QM/MM calculations
+    box : list/iterable, optional
+        The unit cell, if not read from the coordinates
+    pool : Pool, optional
+        An existing Pool set up for this system. If given, prmtop, mm_options,
+        nworkers, qm_options and box are not used to start new workers
+
+    Returns
+    -------
+    result : HessianResult
+    """
+    from . import Pool, _pys, _read_coordinates, _active_setup, _active_parm
+    active_prmtop = None
+    if prmtop is None and pool is None:
+        active_prmtop, active_mm, active_qm = _active_setup()
+        prmtop = active_prmtop
+        if mm_options is None:
+            mm_options = active_mm
+        if qm_options is None:
+            qm_options = active_qm
+    elif pool is None and mm_options is None:
+        raise ValueError('mm_options must be given along with prmtop')
+    if pool is not None:
+        # The active system need not have anything to do with the pool
+        if coordinates is None:
+            raise ValueError('coordinates must be given along with pool')
+        if modes and masses is None:
+            raise ValueError('masses must be given along with pool to '
+                             'compute normal modes')
+    if coordinates is None:
+        coordinates = _np.empty(3 * _pys.natom())
+        _pys.get_positions(coordinates)
+        if box is None:
+            box = _pys.get_box()
+    x0, setup_box = _read_coordinates(coordinates, box)
+    if not setup_box.any():
+        setup_box = None
+    natom = x0.size // 3
+    x0 = x0.reshape((natom, 3))
+    if atoms is None:
+        atoms = _np.arange(natom)
+    else:
+        atoms = _np.unique(_np.asarray(atoms, dtype=_np.intp))
+        if len(atoms) == 0 or atoms[0] < 0 or atoms[-1] >= natom:
+            raise ValueError('atoms must be indices between 0 and %d' % natom)
+    if step <= 0:
+        raise ValueError('step must be positive')
+    coords = (3 * atoms[:,None] + _np.arange(3)).ravel()
+    ncoord = len(coords)
+
+    own_pool = pool is None
+    if own_pool:
+        pool = Pool(prmtop, x0, mm_options, nworkers=nworkers,
+                    qm_options=qm_options, box=setup_box)
+    elif pool.natom != natom:
+        raise ValueError('pool has %d atoms, but %d coordinates were given' %
+                         (pool.natom, natom))
+    try:
+        per_chunk = max(pool.nworkers * pool.batch_size // 2, 1)
+        hess = _np.empty((ncoord, ncoord))
+        row = 0
+        chunks = _displacements(x0, coords, step, per_chunk)
+        for _, frc in pool.imap(chunks, forces=True):
+            frc = frc.reshape((-1, 3 * natom))[:, coords]
+            # d(gradient)/dx = -(F(x+h) - F(x-h)) / 2h
+            n = len(frc) // 2
+            hess[row:row+n] = (frc[1::2] - frc[0::2]) / (2 * step)
+            row += n
+    finally:
+        if own_pool:
+            pool.close()
+    hess = 0.5 * (hess + hess.T)
+
+    frequencies = vectors = None
+    if modes:
+        if masses is None:
+            if prmtop is None or prmtop is active_prmtop:
+                masses = _active_parm().parm_data['MASS']
+            elif isinstance(prmtop, AmberParm):
+                masses = prmtop.parm_data['MASS']
+            else:
+                masses = AmberParm(prmtop).parm_data['MASS']
+        masses = _np.asarray(masses, dtype=_np.float64)[atoms]
+        if not (masses > 0).all():
+            raise ValueError('atoms %s have no positive mass; leave massless '
+                             'sites (e.g., extra points) out with atoms' %
+                             ', '.join(str(i) for i in atoms[masses <= 0]))
+        inv_sqrt_m = _np.repeat(1 / _np.sqrt(masses), 3)
+        evals, vectors = _np.linalg.eigh(hess * _np.outer(inv_sqrt_m, inv_sqrt_m))
+        frequencies = _np.sign(evals) * _np.sqrt(_np.abs(evals)) * _TO_WAVENUMBERS
+
+    return HessianResult(hess, atoms, frequencies, vectors)
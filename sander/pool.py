@@ -0,0 +1,415 @@
+"""
+Parallel evaluation of many frames with a pool of worker processes.
+
+sander can only have one system set up per process, so the only way to use
+more than one core is to run several processes. Each worker in a Pool sets up
+the system once and then evaluates batches of frames with energy_forces_batch.
+Frames and results are exchanged through a ring of slots in one POSIX shared
+memory segment; only slot numbers travel through the (pickling) queues.
+
+Workers are started with the 'spawn' method, so they do not inherit the sander
+state (or a held lock) of the calling process, which may have a system of its
+own set up. As with any spawned process, scripts that create a Pool must guard
+their main code with ``if __name__ == '__main__':``. multiprocessing's shared
+memory needs Python 3.8 or later.
+"""
+from __future__ import print_function, division, absolute_import
+
+import multiprocessing as _mp
+import os
+import tempfile
+import numpy as _np
+from parmed.amber import AmberParm, Rst7
+from parmed.utils.six import string_types
+try:
+    import queue as _queue
+except ImportError:
+    import Queue as _queue
+
+__all__ = ['Pool']
+
+# How long (in seconds) to wait on the result queue before checking that all
+# of the workers are still alive
+_POLL_INTERVAL = 1.0
+
+def _shared_memory(what):
+    """ Returns multiprocessing.shared_memory, which what needs """
+    try:
+        from multiprocessing import shared_memory
+    except ImportError:
+        raise ImportError('%s needs Python 3.8 or later '
+                          '(multiprocessing.shared_memory)' % what)
+    return shared_memory
+
+def _spawn_context():
+    """
+    Returns the multiprocessing context child processes holding their own
+    sander system are started with. They must not be forked, since sander
+    supports one system per process and a fork would inherit the parent's
+    setup (and possibly a held SANDER_LOCK)
+    """
+    return _mp.get_context('spawn')
+
+def _struct_to_dict(struct):
+    """ Converts an InputOptions or QmInputOptions instance to a dict """
+    if struct is None:
+        return None
+    return dict((attr, getattr(struct, attr)) for attr in dir(struct)
+                if not attr.startswith('_'))
+
+def _struct_from_dict(cls, values):
+    """ Rebuilds an InputOptions or QmInputOptions instance from a dict """
+    if values is None:
+        return None
+    struct = cls()
+    for attr, val in values.items():
+        setattr(struct, attr, val)
+    return struct
+
+class _SlotLayout(object):
+    """
+    Describes how the shared memory segment is split up into nslots slots, each
+    holding up to batch_size frames of natom atoms. Every slot has an input
+    region (frames and boxes) and an output region (energies and forces)
+    """
+
+    def __init__(self, nslots, batch_size, natom, nterms):
+        self.nslots = nslots
+        self.batch_size = batch_size
+        self.natom = natom
+        self.nterms = nterms
+        self.shapes = [('frames', (nslots, batch_size, natom, 3)),
+                       ('boxes', (nslots, batch_size, 6)),
+                       ('energies', (nslots, batch_size, nterms)),
+                       ('forces', (nslots, batch_size, natom, 3))]
+
+    @property
+    def nbytes(self):
+        return sum(int(_np.prod(shape)) * 8 for _, shape in self.shapes)
+
+    def views(self, buf):
+        """ Returns a dict of float64 arrays mapped onto the shared buffer """
+        views = dict()
+        offset = 0
+        for name, shape in self.shapes:
+            size = int(_np.prod(shape))
+            views[name] = _np.ndarray(shape, dtype=_np.float64, buffer=buf,
+                                      offset=offset)
+            offset += size * 8
+        return views
+
+def _worker(prmtop, coordinates, box, mm_options, qm_options, shm_name,
+            layout, tasks, results):
+    """ Worker process main loop: set up sander, then evaluate batches """
+    from . import pysander as _pys, setup, InputOptions, QmInputOptions
+    shm = _shared_memory('sander.Pool').SharedMemory(name=shm_name)
+    try:
+        views = layout.views(shm.buf)
+        try:
+            setup(prmtop, coordinates, box,
+                  _struct_from_dict(InputOptions, mm_options),
+                  _struct_from_dict(QmInputOptions, qm_options))
+        except Exception as e:
+            results.put((-1, 'setup failed: %r' % e))
+            return
+        results.put((-1, None))
+        # Batches without boxes use the box the system was set up with, no
+        # matter which boxes this worker happened to evaluate before
+        setup_box = _pys.get_box()
+        box_changed = False
+        while True:
+            task = tasks.get()
+            if task is None:
+                break
+            slot, nframes, has_box, want_forces = task
+            try:
+                if has_box:
+                    box_changed = True
+                elif box_changed:
+                    _pys.set_box(*setup_box)
+                    box_changed = False
+                _pys.energy_forces_batch(
+                        views['frames'][slot, :nframes],
+                        views['boxes'][slot, :nframes] if has_box else None,
+                        views['energies'][slot, :nframes],
+                        views['forces'][slot, :nframes] if want_forces else None)
+            except Exception as e:
+                results.put((slot, repr(e)))
+            else:
+                results.put((slot, None))
+    finally:
+        views = None
+        if _pys.is_setup():
+            _pys.cleanup()
+        shm.close()
+
+class Pool(object):
+    """
+    A pool of worker processes that each hold their own copy of a sander
+    system, used to evaluate many frames in parallel. Requires Python 3.8 or
+    later.
+
+    Parameters
+    ----------
+    prmtop : AmberParm or str
+        Name of the prmtop file to use to set up the calculation or an AmberParm
+        instance
+    inpcrd : list/iterable or str
+        list of coordinates or name of the inpcrd file used to set up the
+        workers (frames evaluated later can have any coordinates)
+    mm_options : InputOptions
+        struct with sander options
+    nworkers : int, optional
+        Number of worker processes. Default is the number of CPUs
+    qm_options : QmInputOptions, optional
+        struct with the QM options in sander QM/MM calculations
+    box : list/iterable, optional
+        list of 3 box lengths and 3 box angles, if not read from inpcrd
+    batch_size : int, optional
+        Number of frames sent to a worker at once (default 32)
+
+    Examples
+    --------
+    >>> with sander.Pool("prmtop", "inpcrd", sander.gas_input(), 8) as pool:
+    ...     energies, forces = pool.map(frames)
+    """
+
+    def __init__(self, prmtop, inpcrd, mm_options, nworkers=None,
+                 qm_options=None, box=None, batch_size=32):
+        from . import ENERGY_TERMS
+        shared_memory = _shared_memory('sander.Pool')
+        if nworkers is None:
+            nworkers = _mp.cpu_count()
+        if nworkers < 1 or batch_size < 1:
+            raise ValueError('nworkers and batch_size must be positive')
+        self._workers = []
+        self._shm = None
+        self._tmpparm = None
+
+        if isinstance(inpcrd, string_types):
+            rst = Rst7.open(inpcrd)
+            inpcrd = rst.coordinates
+            if rst.hasbox and (box is None or box is False):
+                box = rst.box
+        coordinates = _np.ascontiguousarray(inpcrd, dtype=_np.float64)
+        self.natom = coordinates.size // 3
+        self.nworkers = nworkers
+        self.batch_size = batch_size
+
+        # Workers need a prmtop file they can read
+        if isinstance(prmtop, AmberParm):
+            fd, self._tmpparm = tempfile.mkstemp(suffix='.parm7')
+            os.close(fd)
+            prmtop.write_parm(self._tmpparm)
+            prmtop = self._tmpparm
+        elif not isinstance(prmtop, string_types):
+            raise TypeError('prmtop must be an AmberParm or string')
+
+        # Two slots per worker, so each worker has its next batch ready
+        self._layout = _SlotLayout(2 * nworkers, batch_size, self.natom,
+                                   len(ENERGY_TERMS))
+        self._shm = shared_memory.SharedMemory(create=True,
+                                               size=self._layout.nbytes)
+        self._views = self._layout.views(self._shm.buf)
+        self._free = list(range(self._layout.nslots))
+
+        ctx = _spawn_context()
+        self._tasks = ctx.Queue()
+        self._results = ctx.Queue()
+        try:
+            for i in range(nworkers):
+                p = ctx.Process(target=_worker,
+                                args=(prmtop, coordinates, box,
+                                      _struct_to_dict(mm_options),
+                                      _struct_to_dict(qm_options),
+                                      self._shm.name, self._layout,
+                                      self._tasks, self._results))
+                p.daemon = True
+                p.start()
+                self._workers.append(p)
+            # Wait for every worker to finish setting up
+            for i in range(nworkers):
+                slot, err = self._get_result()
+                if err is not None:
+                    raise RuntimeError('Pool worker %s' % err)
+        except:
+            self.close()
+            raise
+        finally:
+            if self._tmpparm is not None:
+                os.unlink(self._tmpparm)
+                self._tmpparm = None
+
+    def _get_result(self):
+        """ Waits for a result, making sure the workers have not died """
+        while True:
+            try:
+                return self._results.get(timeout=_POLL_INTERVAL)
+            except _queue.Empty:
+                for p in self._workers:
+                    if not p.is_alive():
+                        raise RuntimeError('Pool worker %d died with exit code '
+                                           '%s' % (p.pid, p.exitcode))
+
+    def imap(self, chunks, forces=True):
+        """
+        Evaluates an iterable of frame chunks, yielding the results of each
+        chunk in order. Chunks are read from the iterable lazily, so this can
+        process trajectories that do not fit in memory.
+
+        Parameters
+        ----------
+        chunks : iterable
+            Each item is either an array of frames with shape
+            (nframes, natom, 3) or a (frames, boxes) tuple, where boxes has
+            shape (nframes, 6)
+        forces : bool, optional
+            If True (default), forces are computed and returned as well
+
+        Yields
+        ------
+        energies, forces : np.ndarray, np.ndarray or None
+            Per-chunk results, as returned by sander.energy_forces_batch
+        """
+        if self._shm is None:
+            raise RuntimeError('Pool is closed')
+        frames_v, boxes_v = self._views['frames'], self._views['boxes']
+        ene_v, frc_v = self._views['energies'], self._views['forces']
+        pending = []  # [energies, forces, number of unfinished batches]
+        inflight = dict() # slot -> (pending entry, offset, nframes)
+        chunks = iter(chunks)
+        batches = iter(())
+        exhausted = False
+        max_pending = 2 * self._layout.nslots
+        while True:
+            # Fill every free slot with the next batch of frames
+            while self._free and not exhausted:
+                try:
+                    entry, frames, boxes, offset = next(batches)
+                except StopIteration:
+                    if len(pending) >= max_pending:
+                        break
+                    try:
+                        chunk = next(chunks)
+                    except StopIteration:
+                        exhausted = True
+                        break
+                    batches = self._split(chunk, forces, pending)
+                    continue
+                slot = self._free.pop()
+                n = len(frames)
+                frames_v[slot, :n] = frames
+                if boxes is not None:
+                    boxes_v[slot, :n] = boxes
+                inflight[slot] = (entry, offset, n)
+                self._tasks.put((slot, n, boxes is not None, forces))
+            if not inflight:
+                # Either everything is done or we are waiting on no one
+                while pending and pending[0][2] == 0:
+                    entry = pending.pop(0)
+                    yield entry[0], entry[1]
+                if exhausted:
+                    return
+                continue
+            slot, err = self._get_result()
+            entry, offset, n = inflight.pop(slot)
+            self._free.append(slot)
+            if err is not None:
+                self._drain(inflight)
+                raise RuntimeError('Pool worker failed: %s' % err)
+            entry[0][offset:offset+n] = ene_v[slot, :n]
+            if forces:
+                entry[1][offset:offset+n] = frc_v[slot, :n]
+            entry[2] -= 1
+            while pending and pending[0][2] == 0:
+                entry = pending.pop(0)
+                yield entry[0], entry[1]
+
+    def _split(self, chunk, forces, pending):
+        """ Splits a chunk into batches and registers its output arrays """
+        from . import ENERGY_TERMS
+        if isinstance(chunk, tuple):
+            frames, boxes = chunk
+        else:
+            frames, boxes = chunk, None
+        frames = _np.asarray(frames, dtype=_np.float64)
+        nframes = frames.size // (self.natom * 3)
+        if nframes * self.natom * 3 != frames.size:
+            raise ValueError('frames must have nframes*natom*3 elements')
+        frames = frames.reshape((nframes, self.natom, 3))
+        if boxes is not None:
+            boxes = _np.asarray(boxes, dtype=_np.float64)
+            if boxes.shape != (nframes, 6):
+                raise ValueError('boxes must have shape (nframes, 6)')
+        entry = [_np.empty((nframes, len(ENERGY_TERMS))),
+                 _np.empty((nframes, self.natom, 3)) if forces else None,
+                 (nframes + self.batch_size - 1) // self.batch_size]
+        pending.append(entry)
+        batches = []
+        for start in range(0, nframes, self.batch_size):
+            end = min(start + self.batch_size, nframes)
+            batches.append((entry, frames[start:end],
+                            boxes[start:end] if boxes is not None else None,
+                            start))
+        return iter(batches)
+
+    def _drain(self, inflight):
+        """ Collects outstanding results so the slots can be reused """
+        while inflight:
+            slot, err = self._get_result()
+            inflight.pop(slot)
+            self._free.append(slot)
+
+    def map(self, frames, boxes=None, forces=True):
+        """
+        Evaluates the energies (and forces) of many frames in parallel.
+
+        Parameters
+        ----------
+        frames : array of float
+            Positions of every frame, with shape (nframes, natom, 3)
+        boxes : array of float, optional
+            Unit cell of every frame, with shape (nframes, 6)
+        forces : bool, optional
+            If True (default), forces are computed and returned as well
+
+        Returns
+        -------
+        energies, forces : np.ndarray, np.ndarray or None
+            energies has shape (nframes, len(ENERGY_TERMS)) and forces has
+            shape (nframes, natom, 3) (or is None if not requested)
+        """
+        chunk = frames if boxes is None else (frames, boxes)
+        for result in self.imap([chunk], forces=forces):
+            return result
+
+    def close(self):
+        """ Shuts down the workers and frees the shared memory """
+        for p in self._workers:
+            if p.is_alive():
+                self._tasks.put(None)
+        for p in self._workers:
+            p.join()
+        self._workers = []
+        if self._shm is not None:
+            self._views = None
+            try:
+                self._shm.close()
+            except BufferError:
+                # An unfinished imap generator still holds views of the
+                # segment; it is unmapped once the generator is collected
+                pass
+            self._shm.unlink()
+            self._shm = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args, **kwargs):
+        self.close()
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:
+            pass
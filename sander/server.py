@@ -0,0 +1,513 @@
+"""
+A persistent evaluation server that keeps a sander system set up and serves
+energy and force requests over a Unix domain socket, so that short-lived
+scripts do not have to pay the setup cost every time they run.
+
+Each server process holds one system (sander can only set up one system per
+process); run one server per system to keep several resident. Start one from
+Python with start_server(), or from the command line with
+
+    python -m sander.server --socket /tmp/mol.sock prmtop inpcrd [--igb 5]
+
+and talk to it with a Client, which mirrors the sander module API.
+
+Protocol
+--------
+Every message starts with a 16-byte header (all little-endian)::
+
+    4s  magic (b'PSND')
+    B   protocol version
+    B   opcode (requests) or status (responses; 0 is OK, 1 is an error)
+    H   flags
+    Q   payload length in bytes
+
+followed by the payload. Arrays are sent as raw float64 data. Large arrays can
+instead be exchanged through a POSIX shared-memory segment that the client
+creates and registers once per connection with OP_ATTACH (which needs Python
+3.8 or later on both ends; otherwise clients fall back to the socket). Error
+responses carry a UTF-8 error message.
+"""
+from __future__ import print_function, division, absolute_import
+
+import os
+import socket
+import struct
+import threading
+import numpy as _np
+
+__all__ = ['Server', 'Client', 'start_server']
+
+MAGIC = b'PSND'
+VERSION = 1
+_HEADER = struct.Struct('<4sBBHQ')
+
+# Request opcodes
+OP_INFO = 1     # -> natom (uint32), setup box (6 doubles), positions
+OP_ATTACH = 2   # shared memory segment name -> nothing
+OP_EVAL = 3     # positions [+ box] -> energies [+ forces]
+OP_SHUTDOWN = 4 # stop the server
+
+# OP_EVAL flags
+FLAG_BOX = 1    # a box is sent along with the positions
+FLAG_FORCES = 2 # forces are requested
+FLAG_SHM = 4    # arrays are exchanged through the attached shared memory
+
+STATUS_OK = 0
+STATUS_ERROR = 1
+
+# Clients use shared memory by default for systems with at least this many
+# atoms; below that, copying through the socket is cheaper
+SHM_THRESHOLD = 5000
+
+try:
+    import multiprocessing.shared_memory
+    _HAVE_SHARED_MEMORY = True
+except ImportError:
+    # Python < 3.8
+    _HAVE_SHARED_MEMORY = False
+
+def _recv_exact(sock, buf):
+    """ Fills the writable buffer buf from the socket """
+    view = memoryview(buf).cast('B')
+    while len(view):
+        n = sock.recv_into(view)
+        if n == 0:
+            raise EOFError('connection closed')
+        view = view[n:]
+
+def _send(sock, code, flags=0, *payload):
+    """ Sends a message whose payload is the concatenation of the buffers """
+    length = sum(memoryview(p).nbytes for p in payload)
+    sock.sendall(_HEADER.pack(MAGIC, VERSION, code, flags, length))
+    for p in payload:
+        sock.sendall(p)
+
+def _recv_header(sock):
+    """ Receives a message header, returning (code, flags, length) """
+    header = bytearray(_HEADER.size)
+    _recv_exact(sock, header)
+    magic, version, code, flags, length = _HEADER.unpack(bytes(header))
+    if magic != MAGIC or version != VERSION:
+        raise IOError('Bad message header from sander server peer')
+    return code, flags, length
+
+def _recv_payload(sock, length):
+    payload = bytearray(length)
+    _recv_exact(sock, payload)
+    return payload
+
+def _attach_untracked(shared_memory, name):
+    """
+    Attaches to a segment the client owns and leaves it out of the resource
+    tracker of this process, which would otherwise unlink it when the server
+    exits. Before Python 3.13 attaching always registers the segment, so it is
+    unregistered again right away. A server started with start_server shares
+    the tracker of the process that started it, so that also drops the
+    client's own registration when that process is the client;
+    _register_owned puts it back.
+    """
+    try:
+        return shared_memory.SharedMemory(name=name, track=False)
+    except TypeError:
+        pass # Python < 3.13
+    from multiprocessing import resource_tracker
+    shm = shared_memory.SharedMemory(name=name)
+    resource_tracker.unregister(shm._name, 'shared_memory')
+    return shm
+
+def _register_owned(shm):
+    """
+    Registers a segment the client created with its resource tracker again
+    once the server has attached to it, so the segment is still unlinked if
+    the client dies without closing it. Registering is idempotent, so this
+    does nothing unless the server shares the client's tracker
+    """
+    from multiprocessing import resource_tracker
+    resource_tracker.register(shm._name, 'shared_memory')
+
+class _SharedArrays(object):
+    """
+    Shared memory segment holding positions, box, energies and forces for one
+    connection
+    """
+
+    def __init__(self, natom, nterms, name=None):
+        from .pool import _shared_memory
+        shared_memory = _shared_memory('Exchanging arrays through shared '
+                                       'memory')
+        nbytes = 8 * (3 * natom + 6 + nterms + 3 * natom)
+        if name is None:
+            self.shm = shared_memory.SharedMemory(create=True, size=nbytes)
+        else:
+            self.shm = _attach_untracked(shared_memory, name)
+        buf = self.shm.buf
+        off = 0
+        self.positions = _np.ndarray(3*natom, _np.float64, buf, off)
+        off += 3 * natom * 8
+        self.box = _np.ndarray(6, _np.float64, buf, off)
+        off += 6 * 8
+        self.energies = _np.ndarray(nterms, _np.float64, buf, off)
+        off += nterms * 8
+        self.forces = _np.ndarray(3*natom, _np.float64, buf, off)
+
+    @property
+    def name(self):
+        return self.shm.name
+
+    def close(self, unlink=False):
+        self.positions = self.box = self.energies = self.forces = None
+        self.shm.close()
+        if unlink:
+            self.shm.unlink()
+
+class Server(object):
+    """
+    Serves energy and force evaluations of one set-up sander system over a
+    Unix domain socket.
+
+    Parameters
+    ----------
+    socket_path : str
+        Path of the Unix domain socket to listen on
+    prmtop, inpcrd, box, mm_options, qm_options
+        The same arguments taken by sander.setup
+    """
+
+    def __init__(self, socket_path, prmtop, inpcrd, box, mm_options,
+                 qm_options=None):
+        from . import setup, natom, get_box, get_positions, ENERGY_TERMS
+        self.socket_path = socket_path
+        self._context = setup(prmtop, inpcrd, box, mm_options, qm_options)
+        self.natom = natom()
+        self.nterms = len(ENERGY_TERMS)
+        self._setup_box = _np.array(get_box(), dtype=_np.float64)
+        self._setup_positions = _np.array(get_positions(), dtype=_np.float64)
+        self._box_changed = False
+        self._lock = threading.Lock()
+        self._stop = threading.Event()
+        if os.path.exists(socket_path):
+            os.unlink(socket_path)
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.bind(socket_path)
+        self._sock.listen(16)
+
+    def serve_forever(self):
+        """ Accepts connections (one thread each) until shut down """
+        self._sock.settimeout(0.5)
+        try:
+            while not self._stop.is_set():
+                try:
+                    conn, _ = self._sock.accept()
+                except socket.timeout:
+                    continue
+                conn.settimeout(None)
+                t = threading.Thread(target=self._handle, args=(conn,))
+                t.daemon = True
+                t.start()
+        finally:
+            self.close()
+
+    def close(self):
+        self._stop.set()
+        if self._sock is not None:
+            self._sock.close()
+            self._sock = None
+            if os.path.exists(self.socket_path):
+                os.unlink(self.socket_path)
+        from . import is_setup, cleanup
+        if is_setup():
+            cleanup()
+
+    def _evaluate(self, positions, box, energies, forces):
+        """ Runs one evaluation atomically with respect to other clients """
+        from . import pysander as _pys
+        with self._lock:
+            if box is not None:
+                self._box_changed = True
+            elif self._box_changed:
+                box = self._setup_box
+                self._box_changed = False
+            _pys.energy_forces_batch(positions, box, energies, forces)
+
+    def _handle(self, conn):
+        natom3 = 3 * self.natom
+        shared = None
+        positions = _np.empty(natom3)
+        box = _np.empty(6)
+        energies = _np.empty(self.nterms)
+        forces = _np.empty(natom3)
+        try:
+            while True:
+                try:
+                    op, flags, length = _recv_header(conn)
+                except EOFError:
+                    break
+                try:
+                    if op == OP_INFO:
+                        _send(conn, STATUS_OK, 0,
+                              struct.pack('<I', self.natom),
+                              self._setup_box, self._setup_positions)
+                    elif op == OP_ATTACH:
+                        name = bytes(_recv_payload(conn, length)).decode()
+                        if shared is not None:
+                            shared.close()
+                        shared = _SharedArrays(self.natom, self.nterms, name)
+                        _send(conn, STATUS_OK)
+                    elif op == OP_EVAL:
+                        has_box = bool(flags & FLAG_BOX)
+                        want_forces = bool(flags & FLAG_FORCES)
+                        if flags & FLAG_SHM:
+                            if shared is None:
+                                raise ValueError('no shared memory attached')
+                            self._evaluate(shared.positions,
+                                           shared.box if has_box else None,
+                                           shared.energies,
+                                           shared.forces if want_forces else
+                                           None)
+                            _send(conn, STATUS_OK)
+                        else:
+                            expected = 8 * (natom3 + (6 if has_box else 0))
+                            if length != expected:
+                                _recv_payload(conn, length)
+                                raise ValueError('bad payload length')
+                            _recv_exact(conn, positions)
+                            if has_box:
+                                _recv_exact(conn, box)
+                            self._evaluate(positions,
+                                           box if has_box else None,
+                                           energies,
+                                           forces if want_forces else None)
+                            if want_forces:
+                                _send(conn, STATUS_OK, 0, energies, forces)
+                            else:
+                                _send(conn, STATUS_OK, 0, energies)
+                    elif op == OP_SHUTDOWN:
+                        _send(conn, STATUS_OK)
+                        self._stop.set()
+                        break
+                    else:
+                        _recv_payload(conn, length)
+                        raise ValueError('unknown opcode %d' % op)
+                except (EOFError, socket.error):
+                    raise
+                except Exception as e:
+                    _send(conn, STATUS_ERROR, 0, str(e).encode())
+        except (EOFError, socket.error):
+            pass
+        finally:
+            if shared is not None:
+                shared.close()
+            conn.close()
+
+def _run_server(socket_path, prmtop, inpcrd, box, mm_options, qm_options,
+                ready):
+    from .pool import _struct_from_dict
+    from . import InputOptions, QmInputOptions
+    server = Server(socket_path, prmtop, inpcrd, box,
+                    _struct_from_dict(InputOptions, mm_options),
+                    _struct_from_dict(QmInputOptions, qm_options))
+    ready.set()
+    server.serve_forever()
+
+def start_server(socket_path, prmtop, inpcrd, box, mm_options, qm_options=None,
+                 timeout=None):
+    """
+    Starts a Server in a background process and waits for it to be ready.
+    The process is spawned rather than forked, so it sets up its own system
+    even if the caller has one set up (scripts calling this must guard their
+    main code with ``if __name__ == '__main__':``).
+
+    Parameters
+    ----------
+    socket_path : str
+        Path of the Unix domain socket to listen on
+    prmtop, inpcrd, box, mm_options, qm_options
+        The same arguments taken by sander.setup
+    timeout : float, optional
+        Maximum number of seconds to wait for the system to be set up
+
+    Returns
+    -------
+    process : multiprocessing.Process
+        The server process. Stop it with Client(socket_path).shutdown()
+    """
+    import tempfile
+    from parmed.amber import AmberParm
+    from .pool import _spawn_context, _struct_to_dict
+    ctx = _spawn_context()
+    tmpparm = None
+    # The server process needs a prmtop file it can read
+    if isinstance(prmtop, AmberParm):
+        fd, tmpparm = tempfile.mkstemp(suffix='.parm7')
+        os.close(fd)
+        prmtop.write_parm(tmpparm)
+        prmtop = tmpparm
+    try:
+        ready = ctx.Event()
+        p = ctx.Process(target=_run_server,
+                        args=(socket_path, prmtop, inpcrd, box,
+                              _struct_to_dict(mm_options),
+                              _struct_to_dict(qm_options), ready))
+        p.start()
+        while not ready.wait(0.1):
+            if not p.is_alive():
+                raise RuntimeError('sander server failed to start')
+            if timeout is not None:
+                timeout -= 0.1
+                if timeout <= 0:
+                    p.terminate()
+                    raise RuntimeError('timed out waiting for the sander '
+                                       'server')
+    finally:
+        if tmpparm is not None:
+            os.unlink(tmpparm)
+    return p
+
+class Client(object):
+    """
+    Connects to a Server and provides the same functions as the sander module
+    (natom, set_positions, get_positions, set_box, get_box, energy_forces).
+    Positions and box are kept locally and sent with each energy_forces call,
+    so several clients can share one server safely.
+
+    Parameters
+    ----------
+    socket_path : str
+        Path of the server's Unix domain socket
+    use_shm : bool, optional
+        If True, exchange positions and forces through shared memory. The
+        default is to do so for systems with at least SHM_THRESHOLD atoms if
+        shared memory is available (Python 3.8 or later)
+    """
+
+    def __init__(self, socket_path, use_shm=None):
+        from . import ENERGY_TERMS
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(socket_path)
+        self._shared = None
+        payload = self._request(OP_INFO)
+        self._natom = struct.unpack('<I', bytes(payload[:4]))[0]
+        self._box = _np.frombuffer(payload, _np.float64, 6, 4).copy()
+        self._setup_box = self._box.copy()
+        self._positions = _np.frombuffer(payload, _np.float64,
+                                         3*self._natom, 52).copy()
+        self._nterms = len(ENERGY_TERMS)
+        if use_shm is None:
+            use_shm = self._natom >= SHM_THRESHOLD and _HAVE_SHARED_MEMORY
+        if use_shm:
+            self._shared = _SharedArrays(self._natom, self._nterms)
+            self._request(OP_ATTACH, 0, self._shared.name.encode())
+            _register_owned(self._shared.shm)
+
+    def _request(self, op, flags=0, *payload):
+        _send(self._sock, op, flags, *payload)
+        status, _, length = _recv_header(self._sock)
+        data = _recv_payload(self._sock, length)
+        if status != STATUS_OK:
+            raise RuntimeError('sander server: %s' % bytes(data).decode())
+        return data
+
+    def natom(self):
+        """ The number of atoms in the served system """
+        return self._natom
+
+    def is_setup(self):
+        return self._sock is not None
+
+    def set_positions(self, positions):
+        """ Sets the positions used in the next energy_forces call """
+        positions = _np.ascontiguousarray(positions, dtype=_np.float64)
+        if positions.size != 3 * self._natom:
+            raise ValueError('Positions array must have natom*3 elements')
+        self._positions[:] = positions.ravel()
+
+    def get_positions(self, as_numpy=False):
+        if as_numpy:
+            return self._positions.copy()
+        return self._positions.tolist()
+
+    def set_box(self, a, b, c, alpha, beta, gamma):
+        """ Sets the unit cell used in the next energy_forces call """
+        self._box[:] = (a, b, c, alpha, beta, gamma)
+
+    def get_box(self):
+        return tuple(float(x) for x in self._box)
+
+    def energy_forces(self, as_numpy=False, out=None):
+        """
+        Computes the energies and forces of the current positions and box on
+        the server. Arguments and return values are the same as for
+        sander.energy_forces
+        """
+        from . import EnergyTerms
+        has_box = not _np.array_equal(self._box, self._setup_box)
+        flags = FLAG_FORCES | (FLAG_BOX if has_box else 0)
+        ene = EnergyTerms()
+        if self._shared is not None:
+            self._shared.positions[:] = self._positions
+            if has_box:
+                self._shared.box[:] = self._box
+            self._request(OP_EVAL, flags | FLAG_SHM)
+            _np.asarray(ene)[:] = self._shared.energies
+            frc = self._shared.forces
+        else:
+            payload = (self._positions, self._box) if has_box else \
+                      (self._positions,)
+            data = self._request(OP_EVAL, flags, *payload)
+            _np.asarray(ene)[:] = _np.frombuffer(data, _np.float64,
+                                                 self._nterms)
+            frc = _np.frombuffer(data, _np.float64, 3*self._natom,
+                                 8*self._nterms)
+        if out is not None:
+            out = _np.asarray(out)
+            out.reshape(-1)[:] = frc
+            return ene, out
+        if as_numpy:
+            return ene, frc.copy()
+        return ene, frc.tolist()
+
+    def shutdown(self):
+        """ Stops the server and closes this connection """
+        self._request(OP_SHUTDOWN)
+        self.close()
+
+    def close(self):
+        if self._sock is not None:
+            self._sock.close()
+            self._sock = None
+        if self._shared is not None:
+            self._shared.close(unlink=True)
+            self._shared = None
+
+    cleanup = close
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args, **kwargs):
+        self.close()
+
+def main(argv=None):
+    """ Runs a server in the foreground from the command line """
+    import argparse
+    from . import gas_input, pme_input
+    parser = argparse.ArgumentParser(description='Serve sander energies and '
+                                     'forces over a Unix domain socket')
+    parser.add_argument('prmtop', help='Topology file')
+    parser.add_argument('inpcrd', help='Coordinate/restart file')
+    parser.add_argument('--socket', required=True, help='Socket path')
+    group = parser.add_mutually_exclusive_group()
+    group.add_argument('--igb', type=int, default=None,
+                       help='Use gas_input(IGB) options (default igb=6)')
+    group.add_argument('--pme', action='store_true', default=False,
+                       help='Use pme_input() options')
+    args = parser.parse_args(argv)
+    if args.pme:
+        options = pme_input()
+    else:
+        options = gas_input(6 if args.igb is None else args.igb)
+    server = Server(args.socket, args.prmtop, args.inpcrd, None, options)
+    server.serve_forever()
+
+if __name__ == '__main__':
+    main()
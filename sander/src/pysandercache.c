@@ -0,0 +1,217 @@
+/* An opt-in cache of energy and force results, so that optimizers and
+ * calculators asking for the same structure more than once (e.g., energy and
+ * forces in separate calls, or a line search revisiting a point) do not pay
+ * for another evaluation. Entries are keyed on the positions and the box and
+ * evicted least recently used first. Exact matches are found through a hash of
+ * the coordinates; with a tolerance, the stored structures are compared one by
+ * one, which is cheap for the small caches this is meant for. Everything here
+ * runs under SANDER_LOCK (but possibly without the GIL).
+ */
+
+#include <math.h>
+
+typedef struct {
+    uint64_t hash;
+    unsigned long long used;    // Tick of the last lookup or store
+    double box[6];
+    pot_ene ene;
+    double *positions;          // 3*NATOM
+    double *forces;             // 3*NATOM
+} pysander_cache_entry;
+
+/* The cache settings survive cleanup, but the entries belong to the active
+ * system; they are allocated on first use and freed by cleanup
+ */
+static int CACHE_SIZE = 0;
+static double CACHE_TOLERANCE = 0.0;
+static pysander_cache_entry *CACHE = NULL;
+static double *CACHE_DATA = NULL;
+static int CACHE_NUSED = 0;
+static unsigned long long CACHE_TICK = 0;
+static unsigned long long CACHE_HITS = 0, CACHE_MISSES = 0;
+
+// What a structure is looked up (and stored) by
+typedef struct {
+    const double *positions;
+    double box[6];
+    uint64_t hash;
+} pysander_cache_key;
+
+static void
+pysander_free_cache(void) {
+    free(CACHE);
+    free(CACHE_DATA);
+    CACHE = NULL;
+    CACHE_DATA = NULL;
+    CACHE_NUSED = 0;
+}
+
+// Hashes the bit patterns of n doubles, 8 bytes at a time
+static uint64_t
+pysander_hash_doubles(const double *x, Py_ssize_t n, uint64_t h) {
+    Py_ssize_t i;
+    for (i = 0; i < n; i++) {
+        uint64_t bits;
+        memcpy(&bits, x + i, sizeof(bits));
+        h = (h ^ bits) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* Fills in the key of the structure at positions and box, where NULL stands
+ * for the active positions (read into SCRATCH_IN) or box. Returns 0 if caching
+ * is disabled, in which case nothing is read
+ */
+static int
+pysander_cache_key_init(pysander_cache_key *key, const double *positions,
+                        const double *box) {
+    if (CACHE_SIZE == 0)
+        return 0;
+    if (positions == NULL) {
+        get_positions(SCRATCH_IN);
+        positions = SCRATCH_IN;
+    }
+    if (box == NULL)
+        get_box(&key->box[0], &key->box[1], &key->box[2], &key->box[3],
+                &key->box[4], &key->box[5]);
+    else
+        memcpy(key->box, box, sizeof(key->box));
+    key->positions = positions;
+    key->hash = pysander_hash_doubles(key->box, 6,
+            pysander_hash_doubles(positions, 3 * (Py_ssize_t) NATOM,
+                                  0xcbf29ce484222325ULL));
+    return 1;
+}
+
+static int
+pysander_cache_matches(const pysander_cache_entry *entry,
+                       const pysander_cache_key *key) {
+    Py_ssize_t i, n = 3 * (Py_ssize_t) NATOM;
+
+    if (CACHE_TOLERANCE == 0.0)
+        return entry->hash == key->hash &&
+               memcmp(entry->box, key->box, sizeof(key->box)) == 0 &&
+               memcmp(entry->positions, key->positions, n * sizeof(double)) == 0;
+    for (i = 0; i < 6; i++)
+        if (fabs(entry->box[i] - key->box[i]) > CACHE_TOLERANCE)
+            return 0;
+    for (i = 0; i < n; i++)
+        if (fabs(entry->positions[i] - key->positions[i]) > CACHE_TOLERANCE)
+            return 0;
+    return 1;
+}
+
+/* Copies the stored energies and (all) forces of the structure into ene and
+ * forces if the cache holds it. Returns 1 on a hit and 0 on a miss
+ */
+static int
+pysander_cache_fetch(const pysander_cache_key *key, pot_ene *ene,
+                     double *forces) {
+    int i;
+    for (i = 0; i < CACHE_NUSED; i++) {
+        pysander_cache_entry *entry = CACHE + i;
+        if (pysander_cache_matches(entry, key)) {
+            entry->used = ++CACHE_TICK;
+            *ene = entry->ene;
+            memcpy(forces, entry->forces, 3 * (size_t) NATOM * sizeof(double));
+            CACHE_HITS++;
+            return 1;
+        }
+    }
+    CACHE_MISSES++;
+    return 0;
+}
+
+// Stores a result, evicting the least recently used entry if the cache is full
+static void
+pysander_cache_store(const pysander_cache_key *key, const pot_ene *ene,
+                     const double *forces) {
+    size_t n = 3 * (size_t) NATOM;
+    pysander_cache_entry *entry;
+    int i;
+
+    if (CACHE == NULL) {
+        CACHE = (pysander_cache_entry *) calloc(CACHE_SIZE, sizeof(*CACHE));
+        CACHE_DATA = (double *) malloc((2 * n * CACHE_SIZE + 1) *
+                                       sizeof(double));
+        if (CACHE == NULL || CACHE_DATA == NULL) {
+            // Not worth failing the evaluation over; just don't cache
+            pysander_free_cache();
+            return;
+        }
+        for (i = 0; i < CACHE_SIZE; i++) {
+            CACHE[i].positions = CACHE_DATA + 2 * n * i;
+            CACHE[i].forces = CACHE[i].positions + n;
+        }
+    }
+    if (CACHE_NUSED < CACHE_SIZE) {
+        entry = CACHE + CACHE_NUSED++;
+    } else {
+        entry = CACHE;
+        for (i = 1; i < CACHE_SIZE; i++)
+            if (CACHE[i].used < entry->used)
+                entry = CACHE + i;
+    }
+    entry->hash = key->hash;
+    entry->used = ++CACHE_TICK;
+    memcpy(entry->box, key->box, sizeof(key->box));
+    entry->ene = *ene;
+    memcpy(entry->positions, key->positions, n * sizeof(double));
+    memcpy(entry->forces, forces, n * sizeof(double));
+}
+
+/* Sets the number of cached results (0 disables the cache) and the largest
+ * difference of any coordinate at which a stored result is reused. Changing
+ * the settings drops all cached results
+ */
+static PyObject *
+pysander_set_cache(PyObject *self, PyObject *args) {
+    int size;
+    double tolerance = 0.0;
+
+    if (!PyArg_ParseTuple(args, "i|d", &size, &tolerance))
+        return NULL;
+    if (size < 0 || tolerance < 0.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "size and tolerance must not be negative");
+        return NULL;
+    }
+
+    pysander_lock();
+    pysander_free_cache();
+    CACHE_SIZE = size;
+    CACHE_TOLERANCE = tolerance;
+    pysander_unlock();
+
+    Py_RETURN_NONE;
+}
+
+// Drops all cached results and resets the hit and miss counters
+static PyObject *
+pysander_clear_cache(PyObject *self) {
+    pysander_lock();
+    pysander_free_cache();
+    CACHE_HITS = CACHE_MISSES = 0;
+    pysander_unlock();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+pysander_cache_info(PyObject *self) {
+    int size, nused;
+    double tolerance;
+    unsigned long long hits, misses;
+
+    pysander_lock();
+    size = CACHE_SIZE;
+    tolerance = CACHE_TOLERANCE;
+    nused = CACHE_NUSED;
+    hits = CACHE_HITS;
+    misses = CACHE_MISSES;
+    pysander_unlock();
+
+    return Py_BuildValue("{s:i,s:d,s:i,s:K,s:K}", "size", size, "tolerance",
+                         tolerance, "entries", nused, "hits", hits, "misses",
+                         misses);
+}
@@ -0,0 +1,257 @@
+/* Molecular dynamics driven entirely in C. The integrator is velocity Verlet
+ * with an optional Langevin thermostat applied as half-step Ornstein-Uhlenbeck
+ * updates around it (the "OBABO" splitting), which reduces to plain NVE
+ * velocity Verlet when the friction is zero. Forces are computed in place by
+ * sander with the GIL released, and only every nwrite-th step is written to
+ * the caller's output buffers. Frozen atoms get no acceleration, no thermal
+ * noise and zero velocity, so every update leaves them where they are. Every
+ * atom must have a positive mass: sander only rebuilds the positions of
+ * massless extra points (e.g., those of TIP4P/TIP5P water) inside its own MD
+ * loop, so they cannot be integrated here.
+ */
+
+// Converts kcal/mol/Angstrom/amu into Angstrom/ps^2
+#define MD_FORCE_TO_ACCEL 418.4
+// Boltzmann's constant in kcal/mol/K
+#define MD_KB 0.0019872041
+
+typedef struct {
+    int natom;
+    double *x;          // 3*natom positions (Angstroms)
+    double *v;          // 3*natom velocities (Angstroms/ps)
+    const double *mass; // natom masses (amu)
+    double *f;          // 3*natom forces (kcal/mol/Angstrom)
+    double *accel;      // natom factors turning forces into accelerations
+                        // (0 for atoms that do not move)
+    double *sigma;      // natom thermal velocity widths (Angstroms/ps)
+} pysander_md;
+
+static double
+pysander_md_kinetic(const pysander_md *md) {
+    double ke = 0.0;
+    int i;
+    for (i = 0; i < 3 * md->natom; i++)
+        ke += md->mass[i / 3] * md->v[i] * md->v[i];
+    return 0.5 * ke / MD_FORCE_TO_ACCEL;
+}
+
+// Langevin half step: v = c1*v + sqrt(1 - c1^2)*sigma*R
+static void
+pysander_md_thermostat(pysander_md *md, pysander_rng *rng, double c1) {
+    double c2 = sqrt(1.0 - c1 * c1);
+    int i;
+    for (i = 0; i < 3 * md->natom; i++)
+        md->v[i] = c1 * md->v[i] + c2 * md->sigma[i / 3] * pysander_rng_gauss(rng);
+}
+
+static void
+pysander_md_kick(pysander_md *md, double dt) {
+    int i;
+    for (i = 0; i < 3 * md->natom; i++)
+        md->v[i] += dt * md->f[i] * md->accel[i / 3];
+}
+
+/* Runs nsteps of dynamics. Every nwrite steps, the positions are appended to
+ * frames, the potential energy terms to energies and the kinetic energy to
+ * kinetic (each skipped if NULL). Returns the number of frames written; the
+ * energy terms of the last step end up in *ene
+ */
+static Py_ssize_t
+pysander_md_run(pysander_md *md, pysander_rng *rng, Py_ssize_t nsteps,
+                double dt, double gamma, Py_ssize_t nwrite, double *frames,
+                double *energies, double *kinetic, pot_ene *ene) {
+    int natom3 = 3 * md->natom;
+    double c1 = exp(-0.5 * gamma * dt);
+    Py_ssize_t step, nframes = 0;
+    int i;
+
+    set_positions(md->x);
+    energy_forces(ene, md->f);
+
+    for (step = 1; step <= nsteps; step++) {
+        if (gamma > 0.0)
+            pysander_md_thermostat(md, rng, c1);
+        pysander_md_kick(md, 0.5 * dt);
+        for (i = 0; i < natom3; i++)
+            md->x[i] += dt * md->v[i];
+        set_positions(md->x);
+        energy_forces(ene, md->f);
+        pysander_md_kick(md, 0.5 * dt);
+        if (gamma > 0.0)
+            pysander_md_thermostat(md, rng, c1);
+
+        if (step % nwrite == 0) {
+            if (frames)
+                memcpy(frames + nframes * natom3, md->x,
+                       natom3 * sizeof(double));
+            if (energies)
+                pysander_pot_ene_to_array(ene,
+                        energies + nframes * NUM_ENERGY_TERMS);
+            if (kinetic)
+                kinetic[nframes] = pysander_md_kinetic(md);
+            nframes++;
+        }
+    }
+
+    return nframes;
+}
+
+/* Runs dynamics on the active system, starting from (and writing the final
+ * state into) caller-supplied position and velocity buffers
+ */
+static PyObject *
+pysander_dynamics(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"positions", "velocities", "masses", "nsteps",
+                             "dt", "temperature", "gamma", "seed", "nwrite",
+                             "frames", "energies", "kinetic",
+                             "init_velocities", "frozen", NULL};
+    PyObject *pypositions, *pyvelocities, *pymasses;
+    PyObject *pyframes = Py_None, *pyenergies = Py_None, *pykinetic = Py_None;
+    PyObject *pyfrozen = Py_None;
+    Py_buffer positions_view, velocities_view, masses_view;
+    Py_buffer frames_view, energies_view, kinetic_view, frozen_view;
+    const unsigned char *frozen = NULL;
+    Py_ssize_t nsteps, nwrite = 1, nframes, i;
+    double dt, temperature = 300.0, gamma = 0.0;
+    double *frames = NULL, *energies = NULL, *kinetic = NULL, *work = NULL;
+    unsigned long long seed = 0;
+    int init_velocities = 0, ok = 0;
+    pysander_md md;
+    pysander_rng rng;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOnd|ddKnOOOiO", kwlist,
+                                     &pypositions, &pyvelocities, &pymasses,
+                                     &nsteps, &dt, &temperature, &gamma, &seed,
+                                     &nwrite, &pyframes, &pyenergies,
+                                     &pykinetic, &init_velocities, &pyfrozen))
+        return NULL;
+
+    if (nsteps < 0 || nwrite < 1 || dt <= 0.0 || gamma < 0.0 ||
+            temperature < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "nsteps must be >= 0, nwrite >= 1, "
+                        "dt > 0, and gamma and temperature >= 0");
+        return NULL;
+    }
+    nframes = nsteps / nwrite;
+
+    pysander_EnergyTerms *py_energies = (pysander_EnergyTerms *)
+            pysander_EnergyTermsType.tp_alloc(&pysander_EnergyTermsType, 0);
+    if (py_energies == NULL)
+        return NULL;
+
+    pysander_lock();
+
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot run dynamics -- no system set up");
+        return NULL;
+    }
+
+    md.natom = NATOM;
+    md.mass = NULL;
+    positions_view.obj = velocities_view.obj = masses_view.obj = NULL;
+    frames_view.obj = energies_view.obj = kinetic_view.obj = NULL;
+    frozen_view.obj = NULL;
+
+    md.x = pysander_get_output_doubles(pypositions, 3 * (Py_ssize_t) md.natom,
+                                       "positions", &positions_view);
+    if (md.x == NULL)
+        goto done;
+    md.v = pysander_get_output_doubles(pyvelocities, 3 * (Py_ssize_t) md.natom,
+                                       "velocities", &velocities_view);
+    if (md.v == NULL)
+        goto done;
+    md.mass = pysander_get_doubles(pymasses, md.natom, "masses", &masses_view);
+    if (md.mass == NULL)
+        goto done;
+    if (pyframes != Py_None && (frames = pysander_get_output_doubles(pyframes,
+                nframes * 3 * md.natom, "frames", &frames_view)) == NULL)
+        goto done;
+    if (pyenergies != Py_None && (energies = pysander_get_output_doubles(
+                pyenergies, nframes * NUM_ENERGY_TERMS, "energies",
+                &energies_view)) == NULL)
+        goto done;
+    if (pykinetic != Py_None && (kinetic = pysander_get_output_doubles(
+                pykinetic, nframes, "kinetic", &kinetic_view)) == NULL)
+        goto done;
+    if (pyfrozen != Py_None) {
+        if (PyObject_GetBuffer(pyfrozen, &frozen_view, PyBUF_C_CONTIGUOUS) < 0)
+            goto done;
+        if (frozen_view.len != md.natom) {
+            PyErr_Format(PyExc_ValueError,
+                         "frozen must have one byte per atom (%d)", md.natom);
+            goto done;
+        }
+        frozen = (const unsigned char *) frozen_view.buf;
+    }
+    for (i = 0; i < md.natom; i++) {
+        if (!(md.mass[i] > 0.0)) {
+            PyErr_Format(PyExc_ValueError,
+                         "Atom %d does not have a positive mass; massless "
+                         "extra points are not supported", i + 1);
+            goto done;
+        }
+    }
+
+    work = (double *) malloc(5 * (size_t) md.natom * sizeof(double));
+    if (work == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    md.f = work;
+    md.accel = work + 3 * md.natom;
+    md.sigma = md.accel + md.natom;
+    for (i = 0; i < md.natom; i++) {
+        if (frozen && frozen[i]) {
+            md.accel[i] = md.sigma[i] = 0.0;
+            md.v[3*i] = md.v[3*i+1] = md.v[3*i+2] = 0.0;
+            continue;
+        }
+        md.accel[i] = MD_FORCE_TO_ACCEL / md.mass[i];
+        md.sigma[i] = sqrt(MD_KB * temperature * md.accel[i]);
+    }
+    pysander_rng_seed(&rng, (uint64_t) seed);
+    if (init_velocities)
+        for (i = 0; i < 3 * md.natom; i++)
+            md.v[i] = md.sigma[i / 3] * pysander_rng_gauss(&rng);
+
+    POS_VALID = 0;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    nframes = pysander_md_run(&md, &rng, nsteps, dt, gamma, nwrite, frames,
+                              energies, kinetic, &py_energies->energies);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+    ok = 1;
+
+done:
+    pysander_unlock();
+
+    free(work);
+    if (frozen_view.obj)
+        PyBuffer_Release(&frozen_view);
+    if (kinetic_view.obj)
+        PyBuffer_Release(&kinetic_view);
+    if (energies_view.obj)
+        PyBuffer_Release(&energies_view);
+    if (frames_view.obj)
+        PyBuffer_Release(&frames_view);
+    if (md.mass)
+        pysander_release_doubles(&masses_view);
+    if (velocities_view.obj)
+        PyBuffer_Release(&velocities_view);
+    if (positions_view.obj)
+        PyBuffer_Release(&positions_view);
+
+    if (!ok) {
+        Py_DECREF(py_energies);
+        return NULL;
+    }
+
+    pysander_stats_record(STAT_DYNAMICS, t_in, t_call, t_out, 0, 0);
+    return Py_BuildValue("Nn", (PyObject *) py_energies, nframes);
+}
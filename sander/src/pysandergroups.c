@@ -0,0 +1,219 @@
+/* Per-group reduction of forces. Atom groups (e.g., residues or molecules) are
+ * registered once for the active system; afterwards each evaluation returns
+ * the net force and the torque about the center of mass of every group,
+ * computed in one pass over the force array sander fills, instead of all
+ * per-atom forces.
+ */
+
+/* The registered groups. GROUP_OF holds the group of every atom (-1 for atoms
+ * in no group), and GROUP_MASS the weight of every atom in the center of mass.
+ * GROUP_WORK has room for the total mass and center of mass of every group.
+ * They belong to the system set up as number GROUPS_SETUP_COUNT, and are freed
+ * by cleanup. Protected by SANDER_LOCK
+ */
+static int *GROUP_OF = NULL;
+static double *GROUP_MASS = NULL;
+static double *GROUP_WORK = NULL;
+static int NGROUPS = 0;
+static long GROUPS_SETUP_COUNT = -1;
+
+static void
+pysander_free_groups(void) {
+    free(GROUP_OF);
+    free(GROUP_MASS);
+    free(GROUP_WORK);
+    GROUP_OF = NULL;
+    GROUP_MASS = NULL;
+    GROUP_WORK = NULL;
+    NGROUPS = 0;
+    GROUPS_SETUP_COUNT = -1;
+}
+
+/* Reduces the forces on natom atoms at positions x to the net force, the
+ * torque about the center of mass and the center of mass of every group.
+ * The torque of a group is sum(r_i x F_i) - R x F, accumulated in one pass
+ */
+static void
+pysander_reduce_groups(const double *x, const double *f, int natom,
+                       double *gforce, double *gtorque, double *gcom,
+                       double *gmass) {
+    int i, g;
+
+    memset(gforce, 0, 3 * NGROUPS * sizeof(double));
+    memset(gtorque, 0, 3 * NGROUPS * sizeof(double));
+    memset(gcom, 0, 3 * NGROUPS * sizeof(double));
+    memset(gmass, 0, NGROUPS * sizeof(double));
+
+    for (i = 0; i < natom; i++) {
+        const double *r = x + 3 * i, *fi = f + 3 * i;
+        double m = GROUP_MASS[i];
+        if ((g = GROUP_OF[i]) < 0)
+            continue;
+        gforce[3*g] += fi[0];
+        gforce[3*g+1] += fi[1];
+        gforce[3*g+2] += fi[2];
+        gtorque[3*g] += r[1] * fi[2] - r[2] * fi[1];
+        gtorque[3*g+1] += r[2] * fi[0] - r[0] * fi[2];
+        gtorque[3*g+2] += r[0] * fi[1] - r[1] * fi[0];
+        gcom[3*g] += m * r[0];
+        gcom[3*g+1] += m * r[1];
+        gcom[3*g+2] += m * r[2];
+        gmass[g] += m;
+    }
+
+    for (g = 0; g < NGROUPS; g++) {
+        double *R = gcom + 3 * g, *F = gforce + 3 * g, *T = gtorque + 3 * g;
+        if (gmass[g] > 0.0) {
+            R[0] /= gmass[g];
+            R[1] /= gmass[g];
+            R[2] /= gmass[g];
+        }
+        T[0] -= R[1] * F[2] - R[2] * F[1];
+        T[1] -= R[2] * F[0] - R[0] * F[2];
+        T[2] -= R[0] * F[1] - R[1] * F[0];
+    }
+}
+
+/* Registers the atom groups of the active system */
+static PyObject *
+pysander_set_groups(PyObject *self, PyObject *args) {
+
+    PyObject *pygroups, *pymasses;
+    Py_buffer groups_view, masses_view;
+    double *masses;
+    int *group_of = NULL, natom, ngroups = 0;
+    Py_ssize_t i, n;
+
+    if (!PyArg_ParseTuple(args, "OO", &pygroups, &pymasses))
+        return NULL;
+
+    pysander_lock();
+
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot register groups -- no system set up");
+        return NULL;
+    }
+
+    natom = NATOM;
+    masses = pysander_get_doubles(pymasses, natom, "masses", &masses_view);
+    if (masses == NULL) {
+        pysander_unlock();
+        return NULL;
+    }
+    // Group numbers are 1-based, so there can be at most natom groups
+    n = pysander_get_indices(pygroups, natom + 1, &groups_view);
+    if (n < 0)
+        goto error;
+    if (n != natom) {
+        PyErr_Format(PyExc_ValueError, "groups must have %d elements", natom);
+        PyBuffer_Release(&groups_view);
+        goto error;
+    }
+    group_of = (int *) malloc((natom > 0 ? natom : 1) * sizeof(int));
+    if (group_of == NULL) {
+        PyErr_NoMemory();
+        PyBuffer_Release(&groups_view);
+        goto error;
+    }
+    for (i = 0; i < n; i++) {
+        group_of[i] = groups_view.itemsize == 4 ?
+                ((const int32_t *) groups_view.buf)[i] - 1 :
+                (int) ((const int64_t *) groups_view.buf)[i] - 1;
+        if (group_of[i] >= ngroups)
+            ngroups = group_of[i] + 1;
+    }
+    PyBuffer_Release(&groups_view);
+
+    pysander_free_groups();
+    GROUP_OF = group_of;
+    GROUP_MASS = (double *) malloc((natom > 0 ? natom : 1) * sizeof(double));
+    GROUP_WORK = (double *) malloc((4 * (size_t) ngroups + 1) * sizeof(double));
+    if (GROUP_MASS == NULL || GROUP_WORK == NULL) {
+        pysander_free_groups();
+        PyErr_NoMemory();
+        goto error;
+    }
+    memcpy(GROUP_MASS, masses, natom * sizeof(double));
+    NGROUPS = ngroups;
+    GROUPS_SETUP_COUNT = SETUP_COUNT;
+
+    pysander_unlock();
+    pysander_release_doubles(&masses_view);
+    return PyInt_FromLong((long int) ngroups);
+
+error:
+    pysander_unlock();
+    pysander_release_doubles(&masses_view);
+    return NULL;
+}
+
+/* Computes energies and the per-group forces, torques and centers of mass */
+static PyObject *
+pysander_energy_forces_groups(PyObject *self, PyObject *args) {
+
+    PyObject *pyforces, *pytorques, *pycom = Py_None;
+    Py_buffer forces_view, torques_view, com_view;
+    double *gforce, *gtorque, *gcom = NULL;
+    int ok = 0;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    if (!PyArg_ParseTuple(args, "OO|O", &pyforces, &pytorques, &pycom))
+        return NULL;
+
+    pysander_EnergyTerms *py_energies = (pysander_EnergyTerms *)
+            pysander_EnergyTermsType.tp_alloc(&pysander_EnergyTermsType, 0);
+    if (py_energies == NULL)
+        return NULL;
+
+    pysander_lock();
+
+    if (IS_SETUP == 0 || GROUPS_SETUP_COUNT != SETUP_COUNT) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "No groups are registered for the active system");
+        return NULL;
+    }
+
+    forces_view.obj = torques_view.obj = com_view.obj = NULL;
+    if ((gforce = pysander_get_output_doubles(pyforces, 3 * NGROUPS, "forces",
+                                              &forces_view)) == NULL)
+        goto done;
+    if ((gtorque = pysander_get_output_doubles(pytorques, 3 * NGROUPS,
+                                               "torques", &torques_view)) == NULL)
+        goto done;
+    if (pycom != Py_None && (gcom = pysander_get_output_doubles(pycom,
+                3 * NGROUPS, "com", &com_view)) == NULL)
+        goto done;
+
+    // Positions and forces go into the scratch memory, and masses and (if not
+    // requested) centers of mass into GROUP_WORK
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    get_positions(SCRATCH_IN);
+    energy_forces(&py_energies->energies, SCRATCH_FULL);
+    t_out = pysander_now();
+    pysander_reduce_groups(SCRATCH_IN, SCRATCH_FULL, NATOM, gforce, gtorque,
+                           gcom ? gcom : GROUP_WORK + NGROUPS, GROUP_WORK);
+    Py_END_ALLOW_THREADS
+    ok = 1;
+
+done:
+    pysander_unlock();
+    if (com_view.obj)
+        PyBuffer_Release(&com_view);
+    if (torques_view.obj)
+        PyBuffer_Release(&torques_view);
+    if (forces_view.obj)
+        PyBuffer_Release(&forces_view);
+
+    if (!ok) {
+        Py_DECREF(py_energies);
+        return NULL;
+    }
+
+    pysander_stats_record(STAT_ENERGY_FORCES_GROUPS, t_in, t_call, t_out, 0, 0);
+    return (PyObject *) py_energies;
+}
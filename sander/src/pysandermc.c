@@ -0,0 +1,352 @@
+/* Metropolis Monte Carlo driven entirely in C. Every step picks one of a set of
+ * moves at random (a rigid translation or rotation of a group of atoms, or a
+ * rotation of a group about a bond), applies it with a random magnitude,
+ * evaluates the energy with sander and accepts or rejects the new structure
+ * at the given temperature. Only every nwrite-th step is written to the
+ * caller's output buffers.
+ */
+
+enum { MC_TRANSLATE, MC_ROTATE, MC_TORSION, MC_NUM_MOVES };
+
+typedef struct {
+    int type;
+    double size;            // Largest displacement (Angstroms) or angle (rad)
+    int axis[2];            // Torsions rotate about the bond axis[0]-axis[1]
+    const int *atoms;       // The atoms that move
+    int natom;
+} pysander_mc_move;
+
+// Reads element i of an integer buffer checked by pysander_get_ints
+static Py_ssize_t
+pysander_index_at(const Py_buffer *view, Py_ssize_t i) {
+    return view->itemsize == 4 ? ((const int32_t *) view->buf)[i]
+                               : (Py_ssize_t) ((const int64_t *) view->buf)[i];
+}
+
+// Rotates the atoms of a move by angle about the unit vector k through c
+static void
+pysander_mc_rotate(double *x, const pysander_mc_move *move, const double *k,
+                   const double *c, double angle) {
+    double cs = cos(angle), sn = sin(angle);
+    int i;
+
+    for (i = 0; i < move->natom; i++) {
+        double *r = x + 3 * move->atoms[i];
+        double v[3] = {r[0] - c[0], r[1] - c[1], r[2] - c[2]};
+        double kv = k[0] * v[0] + k[1] * v[1] + k[2] * v[2];
+        // Rodrigues' rotation formula
+        r[0] = c[0] + v[0] * cs + (k[1] * v[2] - k[2] * v[1]) * sn +
+               k[0] * kv * (1.0 - cs);
+        r[1] = c[1] + v[1] * cs + (k[2] * v[0] - k[0] * v[2]) * sn +
+               k[1] * kv * (1.0 - cs);
+        r[2] = c[2] + v[2] * cs + (k[0] * v[1] - k[1] * v[0]) * sn +
+               k[2] * kv * (1.0 - cs);
+    }
+}
+
+// Applies a move with a random magnitude to the positions x
+static void
+pysander_mc_apply(double *x, const pysander_mc_move *move, pysander_rng *rng) {
+    double k[3], c[3] = {0.0, 0.0, 0.0}, len, angle;
+    int i, j;
+
+    switch (move->type) {
+    case MC_TRANSLATE:
+        for (j = 0; j < 3; j++)
+            c[j] = move->size * (2.0 * pysander_rng_uniform(rng) - 1.0);
+        for (i = 0; i < move->natom; i++)
+            for (j = 0; j < 3; j++)
+                x[3*move->atoms[i]+j] += c[j];
+        break;
+    case MC_ROTATE:
+        // A uniformly distributed axis through the center of geometry
+        do {
+            for (j = 0; j < 3; j++)
+                k[j] = pysander_rng_gauss(rng);
+            len = sqrt(k[0] * k[0] + k[1] * k[1] + k[2] * k[2]);
+        } while (len == 0.0);
+        for (i = 0; i < move->natom; i++)
+            for (j = 0; j < 3; j++)
+                c[j] += x[3*move->atoms[i]+j] / move->natom;
+        for (j = 0; j < 3; j++)
+            k[j] /= len;
+        angle = move->size * (2.0 * pysander_rng_uniform(rng) - 1.0);
+        pysander_mc_rotate(x, move, k, c, angle);
+        break;
+    case MC_TORSION:
+        for (j = 0; j < 3; j++) {
+            c[j] = x[3*move->axis[1]+j];
+            k[j] = c[j] - x[3*move->axis[0]+j];
+        }
+        len = sqrt(k[0] * k[0] + k[1] * k[1] + k[2] * k[2]);
+        if (len == 0.0)
+            break;
+        for (j = 0; j < 3; j++)
+            k[j] /= len;
+        angle = move->size * (2.0 * pysander_rng_uniform(rng) - 1.0);
+        pysander_mc_rotate(x, move, k, c, angle);
+        break;
+    }
+}
+
+/* Runs nsteps of Metropolis Monte Carlo from the positions x. backup needs room
+ * for the coordinates of the largest move. attempted and accepted count each
+ * move. Every nwrite steps, the positions are appended to frames and the
+ * energy terms to energies (each skipped if NULL). Returns the number of frames
+ * written; the energy terms of the final structure end up in *ene
+ */
+static Py_ssize_t
+pysander_mc_run(double *x, const pysander_mc_move *moves, int nmoves,
+                pysander_rng *rng, Py_ssize_t nsteps, double kt,
+                Py_ssize_t nwrite, double *backup, double *forces,
+                long long *attempted, long long *accepted, double *frames,
+                double *energies, pot_ene *ene) {
+    int natom3 = 3 * NATOM, i;
+    Py_ssize_t step, nframes = 0;
+    pot_ene trial;
+
+    set_positions(x);
+    energy_forces(ene, forces);
+
+    for (step = 1; step <= nsteps; step++) {
+        const pysander_mc_move *move = moves +
+                (int) (pysander_rng_uniform(rng) * nmoves);
+        for (i = 0; i < move->natom; i++)
+            memcpy(backup + 3 * i, x + 3 * move->atoms[i], 3 * sizeof(double));
+        pysander_mc_apply(x, move, rng);
+        /* Only the moved atoms changed in x, but sander only takes complete
+         * coordinate sets, so this is the same push update_positions makes
+         */
+        set_positions(x);
+        energy_forces(&trial, forces);
+
+        double de = trial.tot - ene->tot;
+        attempted[move - moves]++;
+        if (de <= 0.0 || (kt > 0.0 && pysander_rng_uniform(rng) < exp(-de / kt))) {
+            *ene = trial;
+            accepted[move - moves]++;
+        } else {
+            for (i = 0; i < move->natom; i++)
+                memcpy(x + 3 * move->atoms[i], backup + 3 * i,
+                       3 * sizeof(double));
+        }
+
+        if (step % nwrite == 0) {
+            if (frames)
+                memcpy(frames + nframes * natom3, x, natom3 * sizeof(double));
+            if (energies)
+                pysander_pot_ene_to_array(ene,
+                        energies + nframes * NUM_ENERGY_TERMS);
+            nframes++;
+        }
+    }
+
+    /* Leave the last accepted structure as the active one, and as the copy
+     * update_positions patches, so a following update need not read it back
+     */
+    set_positions(x);
+    memcpy(POSITIONS, x, natom3 * sizeof(double));
+    POS_VALID = 1;
+    return nframes;
+}
+
+/* Runs Metropolis Monte Carlo on the active system, starting from (and writing
+ * the final structure into) a caller-supplied position buffer. The moves are
+ * given as flat arrays: the type, size and torsion axis of every move, and the
+ * atoms each one moves as the slice atoms[starts[m]:starts[m+1]]
+ */
+static PyObject *
+pysander_monte_carlo(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"positions", "types", "sizes", "axes", "starts",
+                             "atoms", "nsteps", "temperature", "seed", "nwrite",
+                             "frames", "energies", NULL};
+    PyObject *pypositions, *pytypes, *pysizes, *pyaxes, *pystarts, *pyatoms;
+    PyObject *pyframes = Py_None, *pyenergies = Py_None, *ret = NULL;
+    Py_buffer positions_view, types_view, sizes_view, axes_view, starts_view;
+    Py_buffer atoms_view, frames_view, energies_view;
+    Py_ssize_t nsteps, nwrite = 1, nframes, nmoves = 0, natoms = 0, m, i;
+    double temperature = 300.0, *x, *sizes = NULL, *frames = NULL;
+    double *energies = NULL, *backup = NULL;
+    unsigned long long seed = 0;
+    pysander_mc_move *moves = NULL;
+    int *move_atoms = NULL, maxatoms = 0, ok = 0;
+    long long *counts = NULL;
+    pysander_rng rng;
+    unsigned long long t_in = pysander_now(), t_call = 0, t_out = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOOOn|dKnOO", kwlist,
+                                     &pypositions, &pytypes, &pysizes, &pyaxes,
+                                     &pystarts, &pyatoms, &nsteps, &temperature,
+                                     &seed, &nwrite, &pyframes, &pyenergies))
+        return NULL;
+
+    if (nsteps < 0 || nwrite < 1 || temperature < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "nsteps must be >= 0, nwrite >= 1 "
+                        "and temperature >= 0");
+        return NULL;
+    }
+    nframes = nsteps / nwrite;
+
+    pysander_EnergyTerms *py_energies = (pysander_EnergyTerms *)
+            pysander_EnergyTermsType.tp_alloc(&pysander_EnergyTermsType, 0);
+    if (py_energies == NULL)
+        return NULL;
+
+    pysander_lock();
+
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot run Monte Carlo -- no system set up");
+        return NULL;
+    }
+
+    positions_view.obj = types_view.obj = sizes_view.obj = NULL;
+    axes_view.obj = starts_view.obj = atoms_view.obj = NULL;
+    frames_view.obj = energies_view.obj = NULL;
+
+    x = pysander_get_output_doubles(pypositions, 3 * (Py_ssize_t) NATOM,
+                                    "positions", &positions_view);
+    if (x == NULL)
+        goto done;
+    if ((nmoves = pysander_get_ints(pytypes, "types", &types_view)) < 0)
+        goto done;
+    if (nmoves == 0) {
+        PyErr_SetString(PyExc_ValueError, "At least one move is required");
+        goto done;
+    }
+    if ((sizes = pysander_get_doubles(pysizes, nmoves, "sizes",
+                                      &sizes_view)) == NULL)
+        goto done;
+    if (pysander_get_indices(pyaxes, NATOM, &axes_view) != 2 * nmoves) {
+        if (!PyErr_Occurred())
+            PyErr_Format(PyExc_ValueError, "axes must have %zd elements",
+                         2 * nmoves);
+        goto done;
+    }
+    if ((natoms = pysander_get_indices(pyatoms, NATOM, &atoms_view)) < 0)
+        goto done;
+    if (pysander_get_indices(pystarts, (int) natoms + 1, &starts_view) !=
+            nmoves + 1) {
+        if (!PyErr_Occurred())
+            PyErr_Format(PyExc_ValueError, "starts must have %zd elements",
+                         nmoves + 1);
+        goto done;
+    }
+    if (pyframes != Py_None && (frames = pysander_get_output_doubles(pyframes,
+                nframes * 3 * NATOM, "frames", &frames_view)) == NULL)
+        goto done;
+    if (pyenergies != Py_None && (energies = pysander_get_output_doubles(
+                pyenergies, nframes * NUM_ENERGY_TERMS, "energies",
+                &energies_view)) == NULL)
+        goto done;
+
+    moves = (pysander_mc_move *) malloc(nmoves * sizeof(pysander_mc_move));
+    move_atoms = (int *) malloc((natoms + 1) * sizeof(int));
+    counts = (long long *) calloc(2 * nmoves, sizeof(long long));
+    if (moves == NULL || move_atoms == NULL || counts == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < natoms; i++)
+        move_atoms[i] = (int) pysander_index_at(&atoms_view, i);
+    if (pysander_index_at(&starts_view, 0) != 0 ||
+            pysander_index_at(&starts_view, nmoves) != natoms) {
+        PyErr_SetString(PyExc_ValueError,
+                        "starts must begin with 0 and end with len(atoms)");
+        goto done;
+    }
+    for (m = 0; m < nmoves; m++) {
+        pysander_mc_move *move = moves + m;
+        Py_ssize_t start = pysander_index_at(&starts_view, m);
+        Py_ssize_t end = pysander_index_at(&starts_view, m + 1);
+        Py_ssize_t type = pysander_index_at(&types_view, m);
+        if (type < 0 || type >= MC_NUM_MOVES) {
+            PyErr_Format(PyExc_ValueError, "Move %zd has type %zd; types must "
+                         "be 0 (translate), 1 (rotate) or 2 (torsion)", m,
+                         type);
+            goto done;
+        }
+        move->type = (int) type;
+        move->size = sizes[m];
+        move->axis[0] = (int) pysander_index_at(&axes_view, 2 * m);
+        move->axis[1] = (int) pysander_index_at(&axes_view, 2 * m + 1);
+        move->atoms = move_atoms + start;
+        move->natom = (int) (end - start);
+        if (end < start) {
+            PyErr_SetString(PyExc_ValueError, "starts must not decrease");
+            goto done;
+        }
+        if (move->type == MC_TORSION && move->axis[0] == move->axis[1]) {
+            PyErr_SetString(PyExc_ValueError,
+                            "The axis of a torsion move needs two atoms");
+            goto done;
+        }
+        if (move->natom > maxatoms)
+            maxatoms = move->natom;
+    }
+    backup = (double *) malloc((3 * (size_t) maxatoms + 1) * sizeof(double));
+    if (backup == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    pysander_rng_seed(&rng, (uint64_t) seed);
+
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    nframes = pysander_mc_run(x, moves, (int) nmoves, &rng, nsteps,
+                              MD_KB * temperature, nwrite, backup,
+                              SCRATCH_FULL, counts, counts + nmoves, frames,
+                              energies, &py_energies->energies);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+    ok = 1;
+
+done:
+    pysander_unlock();
+
+    free(backup);
+    free(moves);
+    free(move_atoms);
+    if (energies_view.obj)
+        PyBuffer_Release(&energies_view);
+    if (frames_view.obj)
+        PyBuffer_Release(&frames_view);
+    if (starts_view.obj)
+        PyBuffer_Release(&starts_view);
+    if (atoms_view.obj)
+        PyBuffer_Release(&atoms_view);
+    if (axes_view.obj)
+        PyBuffer_Release(&axes_view);
+    if (sizes)
+        pysander_release_doubles(&sizes_view);
+    if (types_view.obj)
+        PyBuffer_Release(&types_view);
+    if (positions_view.obj)
+        PyBuffer_Release(&positions_view);
+
+    if (ok) {
+        PyObject *attempted = PyList_New(nmoves), *accepted = PyList_New(nmoves);
+        if (attempted != NULL && accepted != NULL) {
+            for (m = 0; m < nmoves; m++) {
+                PyList_SET_ITEM(attempted, m, PyLong_FromLongLong(counts[m]));
+                PyList_SET_ITEM(accepted, m,
+                                PyLong_FromLongLong(counts[nmoves + m]));
+            }
+            ret = Py_BuildValue("NnNN", (PyObject *) py_energies, nframes,
+                                attempted, accepted);
+            py_energies = NULL;
+        } else {
+            Py_XDECREF(attempted);
+            Py_XDECREF(accepted);
+        }
+    }
+    free(counts);
+    Py_XDECREF(py_energies);
+
+    if (ret != NULL)
+        pysander_stats_record(STAT_MONTE_CARLO, t_in, t_call, t_out, 0, 0);
+    return ret;
+}
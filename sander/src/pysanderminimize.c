@@ -0,0 +1,395 @@
+/* Energy minimization driven entirely in C. L-BFGS with a backtracking line
+ * search is used by default; when the line search fails repeatedly (e.g., far
+ * from a minimum, or with a rough energy surface) the minimizer switches to
+ * FIRE for the remaining iterations. Every energy evaluation calls sander
+ * directly on preallocated buffers with the GIL released.
+ */
+
+#include <math.h>
+
+#define MIN_LBFGS 0
+#define MIN_FIRE 1
+
+#define MIN_CONVERGED 0
+#define MIN_MAXITER 1
+
+// Columns of the per-iteration log: energy, RMS force, max force, largest
+// displacement of the step, and the method used for the step
+#define MIN_LOG_COLS 5
+
+// Parameters of the line search and of FIRE (Bitzek et al., PRL 97, 170201)
+#define LS_C1 1e-4
+#define LS_MAXTRY 10
+#define LS_MAXFAIL 2
+#define FIRE_DT 0.1
+#define FIRE_DTMAX 1.0
+#define FIRE_NMIN 5
+#define FIRE_FINC 1.1
+#define FIRE_FDEC 0.5
+#define FIRE_ALPHA 0.1
+#define FIRE_FALPHA 0.99
+
+typedef struct {
+    int natom3;
+    const unsigned char *frozen; // natom flags, or NULL if all atoms move
+    int nevals;
+} pysander_minimizer;
+
+/* Sets the positions to x and computes the energy and the gradient g (minus
+ * the forces), with the gradient of frozen atoms set to 0. Returns the total
+ * energy
+ */
+static double
+pysander_minimize_eval(pysander_minimizer *min, double *x, double *g,
+                       pot_ene *ene) {
+    int i;
+
+    set_positions(x);
+    energy_forces(ene, g);
+    for (i = 0; i < min->natom3; i++)
+        g[i] = -g[i];
+    if (min->frozen)
+        for (i = 0; i < min->natom3; i++)
+            if (min->frozen[i / 3])
+                g[i] = 0.0;
+    min->nevals++;
+    return ene->tot;
+}
+
+// RMS (over the nfree3 moving coordinates) and maximum of the gradient
+static void
+pysander_minimize_gnorm(const double *g, int natom3, int nfree3, double *rms,
+                        double *gmax) {
+    double sum = 0.0, m = 0.0;
+    int i;
+
+    for (i = 0; i < natom3; i++) {
+        sum += g[i] * g[i];
+        if (fabs(g[i]) > m)
+            m = fabs(g[i]);
+    }
+    *rms = nfree3 > 0 ? sqrt(sum / nfree3) : 0.0;
+    *gmax = m;
+}
+
+static double
+pysander_dot(const double *a, const double *b, int n) {
+    double sum = 0.0;
+    int i;
+    for (i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static double
+pysander_absmax(const double *a, int n) {
+    double m = 0.0;
+    int i;
+    for (i = 0; i < n; i++)
+        if (fabs(a[i]) > m)
+            m = fabs(a[i]);
+    return m;
+}
+
+/* L-BFGS two-loop recursion. Computes the search direction d = -H*g from the
+ * last k of the stored (s, y) pairs, where the newest pair is at index head-1
+ * (modulo m)
+ */
+static void
+pysander_lbfgs_direction(const double *g, double *d, const double *s,
+                         const double *y, const double *rho, double *alpha,
+                         int n, int m, int k, int head) {
+    int i, j, idx;
+    double beta, gamma = 1.0;
+
+    for (i = 0; i < n; i++)
+        d[i] = -g[i];
+    for (j = 0; j < k; j++) {
+        idx = (head - 1 - j + m) % m;
+        alpha[idx] = rho[idx] * pysander_dot(s + idx * n, d, n);
+        for (i = 0; i < n; i++)
+            d[i] -= alpha[idx] * y[idx * n + i];
+    }
+    if (k > 0) {
+        idx = (head - 1 + m) % m;
+        gamma = 1.0 / (rho[idx] * pysander_dot(y + idx * n, y + idx * n, n));
+    }
+    for (i = 0; i < n; i++)
+        d[i] *= gamma;
+    for (j = k - 1; j >= 0; j--) {
+        idx = (head - 1 - j + m) % m;
+        beta = rho[idx] * pysander_dot(y + idx * n, d, n);
+        for (i = 0; i < n; i++)
+            d[i] += (alpha[idx] - beta) * s[idx * n + i];
+    }
+}
+
+static void
+pysander_minimize_log(double *log, Py_ssize_t row, double energy, double rms,
+                      double gmax, double step, int method) {
+    if (log == NULL)
+        return;
+    log += row * MIN_LOG_COLS;
+    log[0] = energy;
+    log[1] = rms;
+    log[2] = gmax;
+    log[3] = step;
+    log[4] = (double) method;
+}
+
+/* Runs the minimization on x (which holds the starting structure and receives
+ * the final one). work must hold (5 + 2*m) * natom3 + 2*m doubles. Returns the
+ * number of iterations, with the status in *status and the energy terms of
+ * the final structure in *best
+ */
+static int
+pysander_minimize_run(pysander_minimizer *min, double *x, double *work,
+                      int method, int maxiter, int m, double rms_tol,
+                      double max_tol, double max_step, double *log,
+                      int *status, pot_ene *best) {
+    int n = min->natom3, nfree3 = n, iter, i, k = 0, head = 0, nfail = 0;
+    double *g = work, *xnew = g + n, *gnew = xnew + n, *d = gnew + n;
+    double *v = d + n, *s = v + n, *y = s + m * n, *rho = y + m * n;
+    double *alpha = rho + m;
+    double energy, enew, rms, gmax, step = 0.0, scale, slope, a, sy;
+    double dt = FIRE_DT, fire_alpha = FIRE_ALPHA;
+    int fire_npos = 0, accepted, ntry, used;
+    pot_ene ene;
+
+    if (min->frozen) {
+        nfree3 = 0;
+        for (i = 0; i < n; i++)
+            if (!min->frozen[i / 3])
+                nfree3++;
+    }
+
+    energy = pysander_minimize_eval(min, x, g, best);
+    pysander_minimize_gnorm(g, n, nfree3, &rms, &gmax);
+    pysander_minimize_log(log, 0, energy, rms, gmax, 0.0, method);
+    memset(v, 0, n * sizeof(double));
+
+    for (iter = 0; iter < maxiter; iter++) {
+        if (rms <= rms_tol && gmax <= max_tol) {
+            *status = MIN_CONVERGED;
+            return iter;
+        }
+        used = method;
+        if (method == MIN_LBFGS) {
+            pysander_lbfgs_direction(g, d, s, y, rho, alpha, n, m, k, head);
+            slope = pysander_dot(d, g, n);
+            if (slope >= 0.0) {
+                // Not a descent direction; restart from steepest descent
+                k = 0;
+                for (i = 0; i < n; i++)
+                    d[i] = -g[i];
+                slope = pysander_dot(d, g, n);
+            }
+            // Limit the largest displacement of a full step to max_step
+            scale = pysander_absmax(d, n);
+            if (scale > max_step) {
+                scale = max_step / scale;
+                for (i = 0; i < n; i++)
+                    d[i] *= scale;
+                slope *= scale;
+            }
+            accepted = 0;
+            for (ntry = 0, a = 1.0; ntry < LS_MAXTRY; ntry++, a *= 0.5) {
+                for (i = 0; i < n; i++)
+                    xnew[i] = x[i] + a * d[i];
+                enew = pysander_minimize_eval(min, xnew, gnew, &ene);
+                if (enew <= energy + LS_C1 * a * slope) {
+                    accepted = 1;
+                    break;
+                }
+            }
+            if (!accepted) {
+                // Start over from steepest descent, then give up on L-BFGS
+                k = 0;
+                if (++nfail >= LS_MAXFAIL)
+                    method = MIN_FIRE;
+                set_positions(x);
+                pysander_minimize_log(log, iter + 1, energy, rms, gmax, 0.0,
+                                      MIN_LBFGS);
+                continue;
+            }
+            nfail = 0;
+            step = a * pysander_absmax(d, n);
+            // Store the new curvature pair if it keeps H positive definite
+            for (i = 0; i < n; i++) {
+                s[head * n + i] = xnew[i] - x[i];
+                y[head * n + i] = gnew[i] - g[i];
+            }
+            sy = pysander_dot(s + head * n, y + head * n, n);
+            if (sy > 1e-10) {
+                rho[head] = 1.0 / sy;
+                head = (head + 1) % m;
+                if (k < m)
+                    k++;
+            }
+            memcpy(x, xnew, n * sizeof(double));
+            memcpy(g, gnew, n * sizeof(double));
+            energy = enew;
+            *best = ene;
+        } else {
+            // FIRE: damped dynamics with unit masses and adaptive time step
+            double vnorm, fnorm, power = -pysander_dot(g, v, n);
+            if (power > 0.0) {
+                vnorm = sqrt(pysander_dot(v, v, n));
+                fnorm = sqrt(pysander_dot(g, g, n));
+                for (i = 0; i < n; i++)
+                    v[i] = (1.0 - fire_alpha) * v[i] -
+                           fire_alpha * vnorm * g[i] / fnorm;
+                if (++fire_npos > FIRE_NMIN) {
+                    dt = dt * FIRE_FINC < FIRE_DTMAX ? dt * FIRE_FINC : FIRE_DTMAX;
+                    fire_alpha *= FIRE_FALPHA;
+                }
+            } else {
+                memset(v, 0, n * sizeof(double));
+                dt *= FIRE_FDEC;
+                fire_alpha = FIRE_ALPHA;
+                fire_npos = 0;
+            }
+            for (i = 0; i < n; i++) {
+                v[i] -= dt * g[i];
+                d[i] = dt * v[i];
+            }
+            scale = pysander_absmax(d, n);
+            if (scale > max_step) {
+                scale = max_step / scale;
+                for (i = 0; i < n; i++)
+                    d[i] *= scale;
+            }
+            step = pysander_absmax(d, n);
+            for (i = 0; i < n; i++)
+                x[i] += d[i];
+            energy = pysander_minimize_eval(min, x, g, best);
+        }
+        pysander_minimize_gnorm(g, n, nfree3, &rms, &gmax);
+        pysander_minimize_log(log, iter + 1, energy, rms, gmax, step, used);
+    }
+
+    *status = rms <= rms_tol && gmax <= max_tol ? MIN_CONVERGED : MIN_MAXITER;
+    return iter;
+}
+
+/* Minimizes the active system starting from (and writing the result into) a
+ * caller-supplied coordinate buffer
+ */
+static PyObject *
+pysander_minimize(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"positions", "frozen", "method", "maxiter",
+                             "rms_force", "max_force", "max_step", "memory",
+                             "log", NULL};
+    PyObject *pypositions, *pyfrozen = Py_None, *pylog = Py_None;
+    Py_buffer positions_view, frozen_view, log_view;
+    double *x, *work, *log = NULL;
+    double rms_tol = 1e-2, max_tol = 5e-2, max_step = 0.2;
+    int method = MIN_LBFGS, maxiter = 1000, memory = 10, niter, status, natom;
+    const unsigned char *frozen = NULL;
+    pysander_minimizer min;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiidddiO", kwlist,
+                                     &pypositions, &pyfrozen, &method,
+                                     &maxiter, &rms_tol, &max_tol, &max_step,
+                                     &memory, &pylog))
+        return NULL;
+
+    if (method != MIN_LBFGS && method != MIN_FIRE) {
+        PyErr_SetString(PyExc_ValueError, "method must be 0 (L-BFGS) or 1 (FIRE)");
+        return NULL;
+    }
+    if (maxiter < 0 || memory < 1 || max_step <= 0.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "maxiter must be >= 0, memory >= 1 and max_step > 0");
+        return NULL;
+    }
+
+    pysander_EnergyTerms *py_energies = (pysander_EnergyTerms *)
+            pysander_EnergyTermsType.tp_alloc(&pysander_EnergyTermsType, 0);
+    if (py_energies == NULL)
+        return NULL;
+
+    pysander_lock();
+
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot minimize -- no system set up");
+        return NULL;
+    }
+
+    natom = NATOM;
+    x = pysander_get_output_doubles(pypositions, 3 * (Py_ssize_t) natom,
+                                    "positions", &positions_view);
+    if (x == NULL)
+        goto error_unlock;
+
+    if (pyfrozen != Py_None) {
+        if (PyObject_GetBuffer(pyfrozen, &frozen_view, PyBUF_C_CONTIGUOUS) < 0)
+            goto error_positions;
+        if (frozen_view.len != natom) {
+            PyErr_Format(PyExc_ValueError,
+                         "frozen must have one byte per atom (%d)", natom);
+            PyBuffer_Release(&frozen_view);
+            goto error_positions;
+        }
+        frozen = (const unsigned char *) frozen_view.buf;
+    }
+
+    if (pylog != Py_None) {
+        log = pysander_get_output_doubles(pylog,
+                        (Py_ssize_t) (maxiter + 1) * MIN_LOG_COLS, "log",
+                        &log_view);
+        if (log == NULL)
+            goto error_frozen;
+    }
+
+    work = (double *) malloc(((5 + 2 * (size_t) memory) * 3 * natom +
+                              2 * (size_t) memory) * sizeof(double));
+    if (work == NULL) {
+        PyErr_NoMemory();
+        goto error_log;
+    }
+
+    min.natom3 = 3 * natom;
+    min.frozen = frozen;
+    min.nevals = 0;
+
+    POS_VALID = 0;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    niter = pysander_minimize_run(&min, x, work, method, maxiter, memory,
+                                  rms_tol, max_tol, max_step, log, &status,
+                                  &py_energies->energies);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+
+    pysander_unlock();
+
+    free(work);
+    if (log)
+        PyBuffer_Release(&log_view);
+    if (frozen)
+        PyBuffer_Release(&frozen_view);
+    PyBuffer_Release(&positions_view);
+
+    pysander_stats_record(STAT_MINIMIZE, t_in, t_call, t_out, 0, 0);
+    return Py_BuildValue("Niii", (PyObject *) py_energies, niter, status,
+                         min.nevals);
+
+error_log:
+    if (log)
+        PyBuffer_Release(&log_view);
+error_frozen:
+    if (frozen)
+        PyBuffer_Release(&frozen_view);
+error_positions:
+    PyBuffer_Release(&positions_view);
+error_unlock:
+    pysander_unlock();
+    Py_DECREF(py_energies);
+    return NULL;
+}
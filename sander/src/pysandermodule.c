@@ -3,6 +3,7 @@
 // Python includes
 #include <Python.h>
 #include "structmember.h"
+#include "pythread.h"
 
 // Support versions of Python older than 2.5 that didn't define Py_ssize_t
 #if PY_VERSION_HEX < 0x02050000 && !defined(PY_SSIZE_T_MIN)
@@ -16,7 +17,10 @@ typedef int Py_ssize_t;
 
 // Standard C includes
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // Amber-specific includes
 #include "sander.h"
@@ -33,14 +37,600 @@ typedef int Py_ssize_t;
  */
 static int IS_SETUP = 0;
 
+/* The number of times a system has been set up. This lets callers that cache
+ * information about the active system tell whether it has been replaced
+ */
+static long SETUP_COUNT = 0;
+
+/* Scratch memory sized for the active system, allocated once by setup and
+ * freed by cleanup, so that the steady-state call path makes no heap
+ * allocations. NATOM caches the number of atoms so sander is not queried on
+ * every call. SCRATCH_IN holds input coordinates converted into the form
+ * sander reads, SCRATCH_FULL forces of all atoms that are not returned as
+ * they are (e.g., when only a subset is requested), and SCRATCH_OUT output
+ * coordinates before they are converted into the caller's format. POSITIONS
+ * is a copy of the active positions that update_positions patches; it is only
+ * current while POS_VALID is set, and every call that moves the atoms any
+ * other way clears that flag. Each array holds 3*NATOM doubles and starts on
+ * a cache line. Protected by SANDER_LOCK
+ */
+static int NATOM = 0;
+static double *SCRATCH = NULL;
+static double *SCRATCH_IN = NULL;
+static double *SCRATCH_FULL = NULL;
+static double *SCRATCH_OUT = NULL;
+static double *POSITIONS = NULL;
+static int POS_VALID = 0;
+
+#define PYSANDER_ALIGNMENT 64
+
+// Allocates the scratch memory for natom atoms. Returns 0 on success
+static int
+pysander_alloc_scratch(int natom) {
+    // Round each array up to a whole number of cache lines
+    size_t stride = (3 * (size_t) natom + 7) & ~(size_t) 7;
+    void *mem;
+
+    if (posix_memalign(&mem, PYSANDER_ALIGNMENT,
+                       (4 * stride > 0 ? 4 * stride : 1) * sizeof(double)))
+        return -1;
+    NATOM = natom;
+    SCRATCH = (double *) mem;
+    SCRATCH_IN = SCRATCH;
+    SCRATCH_FULL = SCRATCH + stride;
+    SCRATCH_OUT = SCRATCH + 2 * stride;
+    POSITIONS = SCRATCH + 3 * stride;
+    POS_VALID = 0;
+    return 0;
+}
+
+static void
+pysander_free_scratch(void) {
+    free(SCRATCH);
+    SCRATCH = SCRATCH_IN = SCRATCH_FULL = SCRATCH_OUT = POSITIONS = NULL;
+    POS_VALID = 0;
+    NATOM = 0;
+}
+
+/* The sander library calls below run with the GIL released so that other
+ * Python threads keep running during long computations. SANDER_LOCK serializes
+ * every access to the (process-wide) sander state, including IS_SETUP, so
+ * concurrent callers from different threads simply wait their turn.
+ */
+static PyThread_type_lock SANDER_LOCK = NULL;
+
+/* Acquires SANDER_LOCK, waiting with the GIL released if another thread holds
+ * it. Must be called with the GIL held
+ */
+static void
+pysander_lock(void) {
+    if (!PyThread_acquire_lock(SANDER_LOCK, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(SANDER_LOCK, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void
+pysander_unlock(void) {
+    PyThread_release_lock(SANDER_LOCK);
+}
+
+/* Always-on, low-overhead counters for every entry point that talks to sander.
+ * The time spent in each call is split into converting the Python arguments
+ * ("marshal in", which includes waiting for SANDER_LOCK), the sander library
+ * call itself, and building the Python return values ("marshal out"). The
+ * bytes copied count the coordinate data the binding had to convert or copy
+ * (e.g., Python lists), so it is 0 for calls using buffers in place. Only
+ * successful calls are recorded. Counters are only updated with the GIL held
+ */
+enum {
+    STAT_SETUP, STAT_SET_POSITIONS, STAT_UPDATE_POSITIONS,
+    STAT_GET_POSITIONS, STAT_SET_BOX, STAT_GET_BOX, STAT_ENERGY_FORCES,
+    STAT_ENERGY_FORCES_BATCH, STAT_EVALUATE, STAT_TRAJECTORY, STAT_MINIMIZE,
+    STAT_DYNAMICS, STAT_MONTE_CARLO, STAT_ENERGY_FORCES_GROUPS, STAT_CLEANUP, NUM_STATS
+};
+
+static const char *pysander_stat_names[NUM_STATS] = {
+    "setup", "set_positions", "update_positions", "get_positions", "set_box",
+    "get_box", "energy_forces", "energy_forces_batch", "evaluate", "trajectory",
+    "minimize", "dynamics", "monte_carlo", "energy_forces_groups", "cleanup"
+};
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long ns[3];       // marshal in, sander call, marshal out
+    unsigned long long max_ns[3];
+    unsigned long long bytes_in;    // bytes copied from Python objects
+    unsigned long long bytes_out;   // bytes copied into Python objects
+} pysander_stat;
+
+static pysander_stat STATS[NUM_STATS];
+
+// Monotonic time in nanoseconds
+static unsigned long long
+pysander_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Records one call that started marshaling its input at t_in, called sander at
+ * t_call, and started marshaling its output at t_out. It ends now
+ */
+static void
+pysander_stats_record(int which, unsigned long long t_in,
+                      unsigned long long t_call, unsigned long long t_out,
+                      unsigned long long bytes_in, unsigned long long bytes_out) {
+    unsigned long long dt[3];
+    int i;
+    pysander_stat *stat = &STATS[which];
+
+    dt[0] = t_call - t_in;
+    dt[1] = t_out - t_call;
+    dt[2] = pysander_now() - t_out;
+    stat->calls++;
+    for (i = 0; i < 3; i++) {
+        stat->ns[i] += dt[i];
+        if (dt[i] > stat->max_ns[i])
+            stat->max_ns[i] = dt[i];
+    }
+    stat->bytes_in += bytes_in;
+    stat->bytes_out += bytes_out;
+}
+
+/* Returns the type code of a buffer format string describing a single item
+ * in native byte order (e.g., 'd' or 'f'), or 0 for anything else
+ */
+static char
+pysander_format_code(const char *format) {
+    if (format == NULL)
+        return 0;
+    if (format[0] == '@' || format[0] == '=')
+        format++;
+#if PY_LITTLE_ENDIAN
+    else if (format[0] == '<')
+        format++;
+#else
+    else if (format[0] == '>' || format[0] == '!')
+        format++;
+#endif
+    if (format[0] == '\0' || format[1] != '\0')
+        return 0;
+    return format[0];
+}
+
+/* Returns 1 if the buffer format string describes a native double, 0 otherwise
+ */
+static int
+pysander_is_double_format(const char *format) {
+    return pysander_format_code(format) == 'd';
+}
+
+/* Gets a pointer to the contiguous array of doubles held by obj. Any object
+ * exposing a C-contiguous float64 buffer (numpy arrays, memoryviews,
+ * array.array('d')) is used in place without copying. Lists of floats are
+ * still supported, but are copied into a temporary array. n is the number of
+ * doubles required (or -1 to accept any length). The view must be released
+ * with pysander_release_doubles when the data is no longer needed. Returns
+ * NULL with an exception set on failure
+ */
+static double *
+pysander_get_doubles(PyObject *obj, Py_ssize_t n, const char *name,
+                     Py_buffer *view) {
+
+    view->obj = NULL;
+    view->buf = NULL;
+
+    if (PyObject_CheckBuffer(obj)) {
+        if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+            return NULL;
+        if (!pysander_is_double_format(view->format) ||
+                view->itemsize != sizeof(double)) {
+            PyBuffer_Release(view);
+            PyErr_Format(PyExc_TypeError, "%s must contain float64 data", name);
+            return NULL;
+        }
+        if (n >= 0 && view->len != n * (Py_ssize_t) sizeof(double)) {
+            PyBuffer_Release(view);
+            PyErr_Format(PyExc_ValueError, "%s must have %zd elements",
+                         name, n);
+            return NULL;
+        }
+        return (double *) view->buf;
+    }
+
+    if (!PyList_Check(obj)) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s must be a list or a float64 buffer", name);
+        return NULL;
+    }
+    if (n >= 0 && PyList_Size(obj) != n) {
+        PyErr_Format(PyExc_ValueError, "%s must have %zd elements", name, n);
+        return NULL;
+    }
+
+    Py_ssize_t i, len = PyList_Size(obj);
+    double *data = (double *) malloc((len > 0 ? len : 1) * sizeof(double));
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = 0; i < len; i++)
+        data[i] = PyFloat_AsDouble(PyList_GET_ITEM(obj, i));
+    if (PyErr_Occurred()) {
+        free(data);
+        return NULL;
+    }
+    view->buf = data;
+    view->len = len * (Py_ssize_t) sizeof(double);
+    return data;
+}
+
+/* Gets a pointer to the writable, C-contiguous float64 buffer exposed by obj,
+ * which must hold exactly n doubles (or any number if n is -1). Output is
+ * written directly into this memory. The view must be released with
+ * PyBuffer_Release. Returns NULL with an exception set on failure
+ */
+static double *
+pysander_get_output_doubles(PyObject *obj, Py_ssize_t n, const char *name,
+                            Py_buffer *view) {
+
+    if (PyObject_GetBuffer(obj, view,
+                PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE))
+        return NULL;
+    if (!pysander_is_double_format(view->format) ||
+            view->itemsize != sizeof(double)) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_TypeError, "%s must contain float64 data", name);
+        return NULL;
+    }
+    if (n >= 0 && view->len != n * (Py_ssize_t) sizeof(double)) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_ValueError, "%s must have %zd elements", name, n);
+        return NULL;
+    }
+    return (double *) view->buf;
+}
+
+// Number of bytes pysander_get_doubles had to copy to produce the view
+static Py_ssize_t
+pysander_copied_bytes(const Py_buffer *view) {
+    return view->obj == NULL ? view->len : 0;
+}
+
+/* Releases data obtained from pysander_get_doubles */
+static void
+pysander_release_doubles(Py_buffer *view) {
+    if (view->obj != NULL)
+        PyBuffer_Release(view);
+    else
+        free(view->buf);
+    view->buf = NULL;
+}
+
+/* Coordinates (positions and forces) can be exchanged with the caller as
+ * float64 or float32, in sander's own xyzxyz... order (array of structures,
+ * AoS) or as all x, then all y, then all z (structure of arrays, SoA).
+ * Everything but float64 AoS is converted with these loops
+ */
+static void
+pysander_coords_to_aos(const void *src, int is_float, int soa, int natom,
+                       double *dst) {
+    Py_ssize_t i, n = natom;
+    if (is_float) {
+        const float *in = (const float *) src;
+        if (soa)
+            for (i = 0; i < n; i++) {
+                dst[3*i] = in[i];
+                dst[3*i+1] = in[n+i];
+                dst[3*i+2] = in[2*n+i];
+            }
+        else
+            for (i = 0; i < 3 * n; i++)
+                dst[i] = in[i];
+    } else {
+        const double *in = (const double *) src;
+        if (soa)
+            for (i = 0; i < n; i++) {
+                dst[3*i] = in[i];
+                dst[3*i+1] = in[n+i];
+                dst[3*i+2] = in[2*n+i];
+            }
+        else
+            memcpy(dst, in, 3 * n * sizeof(double));
+    }
+}
+
+static void
+pysander_coords_from_aos(const double *src, void *dst, int is_float, int soa,
+                         int natom) {
+    Py_ssize_t i, n = natom;
+    if (is_float) {
+        float *out = (float *) dst;
+        if (soa)
+            for (i = 0; i < n; i++) {
+                out[i] = (float) src[3*i];
+                out[n+i] = (float) src[3*i+1];
+                out[2*n+i] = (float) src[3*i+2];
+            }
+        else
+            for (i = 0; i < 3 * n; i++)
+                out[i] = (float) src[i];
+    } else {
+        double *out = (double *) dst;
+        if (soa)
+            for (i = 0; i < n; i++) {
+                out[i] = src[3*i];
+                out[n+i] = src[3*i+1];
+                out[2*n+i] = src[3*i+2];
+            }
+        else
+            memcpy(out, src, 3 * n * sizeof(double));
+    }
+}
+
+/* Gets the coordinates of natom atoms from obj in the AoS float64 form sander
+ * reads. float64 AoS buffers are used in place, while float32 buffers, the SoA
+ * layout and lists are converted into scratch (if not NULL, e.g. SCRATCH_IN)
+ * or else a temporary array. The view must be released with
+ * pysander_release_doubles; it is left without a buffer to free when scratch
+ * is used. Returns NULL with an exception set on failure
+ */
+static double *
+pysander_get_coords(PyObject *obj, int natom, int soa, double *scratch,
+                    const char *name, Py_buffer *view) {
+
+    Py_ssize_t i, n = 3 * (Py_ssize_t) natom;
+    double *data;
+
+    if (!PyObject_CheckBuffer(obj)) {
+        if (!PyList_Check(obj)) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s must be a list or a float64 buffer", name);
+            return NULL;
+        }
+        if (PyList_Size(obj) != n) {
+            PyErr_Format(PyExc_ValueError, "%s must have %zd elements",
+                         name, n);
+            return NULL;
+        }
+        data = scratch ? scratch
+                       : (double *) malloc((n > 0 ? n : 1) * sizeof(double));
+        if (data == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            // List input in the SoA layout holds all x, then y, then z
+            Py_ssize_t j = soa ? 3 * (i % natom) + i / natom : i;
+            data[j] = PyFloat_AsDouble(PyList_GET_ITEM(obj, i));
+        }
+        if (PyErr_Occurred()) {
+            if (data != scratch)
+                free(data);
+            return NULL;
+        }
+        view->obj = NULL;
+        view->buf = data == scratch ? NULL : data;
+        view->len = n * (Py_ssize_t) sizeof(double);
+        return data;
+    }
+
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+        return NULL;
+    char code = pysander_format_code(view->format);
+    int is_float = code == 'f' && view->itemsize == sizeof(float);
+    if (!is_float && !(code == 'd' && view->itemsize == sizeof(double))) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_TypeError, "%s must contain float64 or float32 data",
+                     name);
+        return NULL;
+    }
+    if (view->len != n * view->itemsize) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_ValueError, "%s must have %zd elements", name, n);
+        return NULL;
+    }
+    if (!is_float && !soa)
+        return (double *) view->buf;
+
+    data = scratch ? scratch
+                   : (double *) malloc((n > 0 ? n : 1) * sizeof(double));
+    if (data == NULL) {
+        PyBuffer_Release(view);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    pysander_coords_to_aos(view->buf, is_float, soa, natom, data);
+    PyBuffer_Release(view);
+    view->obj = NULL;
+    view->buf = data == scratch ? NULL : data;
+    view->len = n * (Py_ssize_t) sizeof(double);
+    return data;
+}
+
+/* Where coordinates returned to the caller go: either a writable float64 or
+ * float32 buffer supplied by the caller, or a new list. sander always writes
+ * AoS float64 into aos, which is the caller's buffer itself when no conversion
+ * is needed, and otherwise scratch memory or a temporary array
+ */
+typedef struct {
+    PyObject *obj;      // The caller's buffer, or NULL to build a list
+    Py_buffer view;
+    double *aos;
+    int owns_aos;       // Whether aos was allocated here and must be freed
+    int natom;
+    int is_float;
+    int soa;
+} pysander_coords_out;
+
+/* Prepares the destination, using scratch (if not NULL) for the AoS data when
+ * it cannot go into the caller's buffer directly. The result must be finished
+ * while scratch is still reserved. Returns 0 on success, or -1 with an
+ * exception set
+ */
+static int
+pysander_coords_out_init(pysander_coords_out *out, PyObject *obj, int natom,
+                         int soa, double *scratch, const char *name) {
+
+    Py_ssize_t n = 3 * (Py_ssize_t) natom;
+
+    out->obj = obj == Py_None ? NULL : obj;
+    out->natom = natom;
+    out->is_float = 0;
+    out->soa = soa;
+    out->aos = NULL;
+    out->owns_aos = 0;
+
+    if (out->obj) {
+        if (PyObject_GetBuffer(obj, &out->view,
+                    PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE))
+            return -1;
+        char code = pysander_format_code(out->view.format);
+        out->is_float = code == 'f' && out->view.itemsize == sizeof(float);
+        if (!out->is_float &&
+                !(code == 'd' && out->view.itemsize == sizeof(double))) {
+            PyBuffer_Release(&out->view);
+            PyErr_Format(PyExc_TypeError,
+                         "%s must contain float64 or float32 data", name);
+            return -1;
+        }
+        if (out->view.len != n * out->view.itemsize) {
+            PyBuffer_Release(&out->view);
+            PyErr_Format(PyExc_ValueError, "%s must have %zd elements", name, n);
+            return -1;
+        }
+        if (!out->is_float && !soa) {
+            out->aos = (double *) out->view.buf;
+            return 0;
+        }
+    }
+    if (scratch) {
+        out->aos = scratch;
+        return 0;
+    }
+    out->aos = (double *) malloc((n > 0 ? n : 1) * sizeof(double));
+    if (out->aos == NULL) {
+        if (out->obj)
+            PyBuffer_Release(&out->view);
+        PyErr_NoMemory();
+        return -1;
+    }
+    out->owns_aos = 1;
+    return 0;
+}
+
+/* Converts what sander wrote into the caller's buffer. Does not need the GIL */
+static void
+pysander_coords_out_convert(pysander_coords_out *out) {
+    if (out->obj && out->aos != (double *) out->view.buf)
+        pysander_coords_from_aos(out->aos, out->view.buf, out->is_float,
+                                 out->soa, out->natom);
+}
+
+/* Releases the destination, returning a new reference to the result (the
+ * caller's buffer or a new list). *copied is increased by the bytes copied
+ * into the list, if one was built
+ */
+static PyObject *
+pysander_coords_out_finish(pysander_coords_out *out,
+                           unsigned long long *copied) {
+
+    PyObject *ret = NULL;
+    Py_ssize_t i, n = 3 * (Py_ssize_t) out->natom;
+
+    if (out->obj) {
+        if (out->owns_aos)
+            free(out->aos);
+        PyBuffer_Release(&out->view);
+        Py_INCREF(out->obj);
+        return out->obj;
+    }
+    if ((ret = PyList_New(n)) != NULL) {
+        for (i = 0; i < n; i++) {
+            // List output in the SoA layout holds all x, then y, then z
+            Py_ssize_t j = out->soa ? 3 * (i % out->natom) + i / out->natom : i;
+            PyList_SET_ITEM(ret, i, PyFloat_FromDouble(out->aos[j]));
+        }
+        *copied += n * sizeof(double);
+    }
+    if (out->owns_aos)
+        free(out->aos);
+    return ret;
+}
+
+/* Gets the integers held by a C-contiguous int32 or int64 buffer (e.g., a
+ * numpy array of type np.intp). The view must be released with
+ * PyBuffer_Release. Returns the number of integers, or -1 with an exception
+ * set on failure
+ */
+static Py_ssize_t
+pysander_get_ints(PyObject *obj, const char *name, Py_buffer *view) {
+
+    char code;
+
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+        return -1;
+    code = pysander_format_code(view->format);
+    if (!((view->itemsize == 4 && (code == 'i' || code == 'l')) ||
+          (view->itemsize == 8 && (code == 'l' || code == 'q')))) {
+        PyBuffer_Release(view);
+        PyErr_Format(PyExc_TypeError, "%s must contain int32 or int64 values",
+                     name);
+        return -1;
+    }
+    return view->len / view->itemsize;
+}
+
+/* Gets the atom indices held by an int32 or int64 buffer (see
+ * pysander_get_ints), checking that each lies in [0, natom). Returns the
+ * number of indices, or -1 with an exception set on failure
+ */
+static Py_ssize_t
+pysander_get_indices(PyObject *obj, int natom, Py_buffer *view) {
+
+    Py_ssize_t i, n;
+
+    if ((n = pysander_get_ints(obj, "atoms", view)) < 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        long long idx = view->itemsize == 4 ? ((const int32_t *) view->buf)[i]
+                                           : ((const int64_t *) view->buf)[i];
+        if (idx < 0 || idx >= natom) {
+            PyBuffer_Release(view);
+            PyErr_Format(PyExc_IndexError, "atom index %lld out of range for "
+                         "%d atoms", idx, natom);
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* Copies the coordinates of the n atoms indexed by indices out of the full
+ * AoS array src into dst
+ */
+static void
+pysander_gather_coords(const double *src, const Py_buffer *indices,
+                       Py_ssize_t n, double *dst) {
+    Py_ssize_t i, j;
+    for (i = 0; i < n; i++) {
+        j = indices->itemsize == 4 ? ((const int32_t *) indices->buf)[i]
+                                   : ((const int64_t *) indices->buf)[i];
+        dst[3*i] = src[3*j];
+        dst[3*i+1] = src[3*j+1];
+        dst[3*i+2] = src[3*j+2];
+    }
+}
+
 /* Sander setup routine -- sets up a calculation to run with the given prmtop
  * file, inpcrd file, and input options. */
 static PyObject*
 pysander_setup(PyObject *self, PyObject *args) {
 
     char *prmtop;
-    double *coordinates;
-    double box[6];
+    double *coordinates, *box;
+    Py_buffer coordinates_view, box_view;
     size_t i;
     PyObject *arg2, *arg3, *arg4, *arg5;
     arg2 = NULL; arg3 = NULL; arg4 = NULL; arg5 = NULL;
@@ -48,6 +638,8 @@ pysander_setup(PyObject *self, PyObject *args) {
     sander_input input;
     qmmm_input_options qm_input;
 
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
     // Needed to blank-out the strings
     qm_sander_input(&qm_input);
 
@@ -55,26 +647,18 @@ pysander_setup(PyObject *self, PyObject *args) {
     if (!PyArg_ParseTuple(args, "sOOO|O", &prmtop, &arg2, &arg3, &arg4, &arg5))
         return NULL;
 
-    if (IS_SETUP) {
-        // Raise a RuntimeError
-        PyErr_SetString(PyExc_RuntimeError,
-                        "A sander system is already set up!");
-        return NULL;
-    }
-
     pysander_InputOptions *mm_inp;
     pysander_QmInputOptions *qm_inp;
 
-    if (!PyList_Check(arg2)) {
-        PyErr_SetString(PyExc_TypeError, "2nd argument must be a list");
+    if (!PyList_Check(arg2) && !PyObject_CheckBuffer(arg2)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "2nd argument must be a list or a float64 buffer");
         return NULL;
     }
 
-    if (!PyList_Check(arg3)) {
-        PyErr_SetString(PyExc_TypeError, "3rd argument must be a list");
-        return NULL;
-    } else if (PyList_Size(arg3) != 6) {
-        PyErr_SetString(PyExc_ValueError, "3rd argument must have 6 elements");
+    if (!PyList_Check(arg3) && !PyObject_CheckBuffer(arg3)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "3rd argument must be a list or a float64 buffer");
         return NULL;
     }
 
@@ -342,23 +926,61 @@ pysander_setup(PyObject *self, PyObject *args) {
         }
     }
 
-    Py_ssize_t ii;
-    coordinates = (double *)malloc(PyList_Size(arg2)*sizeof(double));
-    // Fill up the positions and box
-    for (ii = 0; ii < PyList_Size(arg2); ii++)
-        coordinates[ii] = PyFloat_AsDouble(PyList_GetItem(arg2, ii));
-    for (ii = 0; ii < 6; ii++)
-        box[ii] = PyFloat_AsDouble(PyList_GetItem(arg3, ii));
+    // Get the positions and box (without copying, if possible)
+    coordinates = pysander_get_doubles(arg2, -1, "coordinates",
+                                       &coordinates_view);
+    if (coordinates == NULL)
+        return NULL;
+    box = pysander_get_doubles(arg3, 6, "box", &box_view);
+    if (box == NULL) {
+        pysander_release_doubles(&coordinates_view);
+        return NULL;
+    }
+
+    pysander_lock();
 
-    if (sander_setup(prmtop, coordinates, box, &input, &qm_input)) {
-        free(coordinates);
-        PyErr_SetString(PyExc_RuntimeError, "Problem setting up sander");
+    if (IS_SETUP) {
+        pysander_unlock();
+        pysander_release_doubles(&coordinates_view);
+        pysander_release_doubles(&box_view);
+        // Raise a RuntimeError
+        PyErr_SetString(PyExc_RuntimeError,
+                        "A sander system is already set up!");
         return NULL;
     }
 
-    free(coordinates);
-    IS_SETUP = 1;
+    int err, nomem = 0;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    err = sander_setup(prmtop, coordinates, box, &input, &qm_input);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+
+    if (!err && pysander_alloc_scratch(sander_natom())) {
+        sander_cleanup();
+        err = nomem = 1;
+    }
+    if (!err) {
+        IS_SETUP = 1;
+        SETUP_COUNT++;
+    }
+    pysander_unlock();
+
+    unsigned long long copied = pysander_copied_bytes(&coordinates_view) +
+                                pysander_copied_bytes(&box_view);
+    pysander_release_doubles(&coordinates_view);
+    pysander_release_doubles(&box_view);
+
+    if (nomem) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (err) {
+        PyErr_SetString(PyExc_RuntimeError, "Problem setting up sander");
+        return NULL;
+    }
 
+    pysander_stats_record(STAT_SETUP, t_in, t_call, t_out, copied, 0);
     Py_RETURN_NONE;
 }
 
@@ -366,40 +988,108 @@ static PyObject*
 pysander_set_positions(PyObject *self, PyObject *args) {
     PyObject *pypositions;
     double *positions;
+    Py_buffer view;
+    int soa = 0;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
 
-    if (!PyArg_ParseTuple(args, "O", &pypositions))
+    if (!PyArg_ParseTuple(args, "O|i", &pypositions, &soa))
         return NULL;
 
+    pysander_lock();
+
     if (!IS_SETUP) {
+        pysander_unlock();
         PyErr_SetString(PyExc_RuntimeError,
                         "No sander system is currently set up!");
         return NULL;
     }
 
-    // Check that the passed positions is legitimate
-
-    if (!PyList_Check(pypositions)) {
-        PyErr_SetString(PyExc_TypeError,
-                        "set_positions expects a list of coordinates");
+    // Check that the passed positions is legitimate and get at its data
+    positions = pysander_get_coords(pypositions, NATOM, soa, SCRATCH_IN,
+                                    "positions", &view);
+    if (positions == NULL) {
+        pysander_unlock();
         return NULL;
     }
 
-    if (PyList_Size(pypositions) != 3 * sander_natom()) {
-        PyErr_SetString(PyExc_ValueError,
-                        "coordinate list must have length 3*natom");
+    POS_VALID = 0;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    set_positions(positions);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+
+    pysander_unlock();
+    unsigned long long copied = pysander_copied_bytes(&view);
+    pysander_release_doubles(&view);
+    pysander_stats_record(STAT_SET_POSITIONS, t_in, t_call, t_out, copied, 0);
+    Py_RETURN_NONE;
+}
+
+/* Moves a subset of the atoms. The new coordinates are patched into the copy
+ * of the active positions kept in POSITIONS (read back from sander only if
+ * something else moved the atoms since the last update), which is then handed
+ * to sander, so the cost of crossing the Python boundary scales with the
+ * number of atoms moved rather than the size of the system
+ */
+static PyObject *
+pysander_update_positions(PyObject *self, PyObject *args) {
+    PyObject *pyindices, *pycoords;
+    Py_buffer indices_view, coords_view;
+    Py_ssize_t i, n;
+    double *coords;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    if (!PyArg_ParseTuple(args, "OO", &pyindices, &pycoords))
         return NULL;
-    }
 
-    // Now allocate the positions and assign them all
-    positions = (double *)malloc(sander_natom()*3*sizeof(double));
+    pysander_lock();
+
+    if (!IS_SETUP) {
+        pysander_unlock();
+        PyErr_SetString(PyExc_RuntimeError,
+                        "No sander system is currently set up!");
+        return NULL;
+    }
 
-    Py_ssize_t i;
-    for (i = 0; i < sander_natom()*3; i++) {
-        positions[(size_t)i] = PyFloat_AsDouble(PyList_GetItem(pypositions, i));
+    n = pysander_get_indices(pyindices, NATOM, &indices_view);
+    if (n < 0) {
+        pysander_unlock();
+        return NULL;
+    }
+    // Repeated indices could make for more coordinates than fit in scratch
+    coords = pysander_get_coords(pycoords, (int) n, 0,
+                                 n <= NATOM ? SCRATCH_IN : NULL, "coords",
+                                 &coords_view);
+    if (coords == NULL) {
+        PyBuffer_Release(&indices_view);
+        pysander_unlock();
+        return NULL;
     }
 
-    set_positions(positions);
-    free(positions);
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    if (!POS_VALID)
+        get_positions(POSITIONS);
+    for (i = 0; i < n; i++) {
+        Py_ssize_t k = indices_view.itemsize == 4 ?
+                ((const int32_t *) indices_view.buf)[i] :
+                (Py_ssize_t) ((const int64_t *) indices_view.buf)[i];
+        POSITIONS[3*k] = coords[3*i];
+        POSITIONS[3*k+1] = coords[3*i+1];
+        POSITIONS[3*k+2] = coords[3*i+2];
+    }
+    set_positions(POSITIONS);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+    POS_VALID = 1;
+
+    pysander_unlock();
+    unsigned long long copied = pysander_copied_bytes(&coords_view);
+    pysander_release_doubles(&coords_view);
+    PyBuffer_Release(&indices_view);
+    pysander_stats_record(STAT_UPDATE_POSITIONS, t_in, t_call, t_out, copied,
+                          0);
     Py_RETURN_NONE;
 }
 
@@ -407,17 +1097,28 @@ static PyObject*
 pysander_set_box(PyObject *self, PyObject *args) {
 
     double a, b, c, alpha, beta, gamma;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
 
     if (!PyArg_ParseTuple(args, "dddddd", &a, &b, &c, &alpha, &beta, &gamma))
         return NULL;
 
+    pysander_lock();
+
     if (!IS_SETUP) {
+        pysander_unlock();
         PyErr_SetString(PyExc_RuntimeError,
                         "No sander system is currently set up!");
         return NULL;
     }
 
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
     set_box(a, b, c, alpha, beta, gamma);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+
+    pysander_unlock();
+    pysander_stats_record(STAT_SET_BOX, t_in, t_call, t_out, 0, 0);
 
     Py_RETURN_NONE;
 }
@@ -426,13 +1127,24 @@ static PyObject*
 pysander_get_box(PyObject *self) {
 
     double a, b, c, alpha, beta, gamma;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    pysander_lock();
 
     if (!IS_SETUP) {
+        pysander_unlock();
         PyErr_SetString(PyExc_RuntimeError,
                         "No sander system is currently set up!");
         return NULL;
     }
+
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
     get_box(&a, &b, &c, &alpha, &beta, &gamma);
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+
+    pysander_unlock();
 
     PyObject *ret = PyTuple_New(6);
     PyTuple_SET_ITEM(ret, 0, PyFloat_FromDouble(a));
@@ -442,21 +1154,41 @@ pysander_get_box(PyObject *self) {
     PyTuple_SET_ITEM(ret, 4, PyFloat_FromDouble(beta));
     PyTuple_SET_ITEM(ret, 5, PyFloat_FromDouble(gamma));
 
+    pysander_stats_record(STAT_GET_BOX, t_in, t_call, t_out, 0, 0);
     return ret;
 }
 
+// The result cache is used by cleanup, energy_forces and evaluate below
+#include "pysandercache.c"
+
+// Releases the registered atom groups (see pysandergroups.c)
+static void pysander_free_groups(void);
+
 /* Deallocates the memory used by sander so sander can be set up and used again
  */
 static PyObject*
 pysander_cleanup(PyObject *self) {
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    pysander_lock();
     if (!IS_SETUP) {
+        pysander_unlock();
         // Raise a RuntimeError
         PyErr_SetString(PyExc_RuntimeError,
                         "No sander system is currently set up!");
         return NULL;
     }
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
     sander_cleanup();
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
     IS_SETUP = 0;
+    pysander_free_scratch();
+    pysander_free_cache();
+    pysander_free_groups();
+    pysander_unlock();
+    pysander_stats_record(STAT_CLEANUP, t_in, t_call, t_out, 0, 0);
     Py_RETURN_NONE;
 }
 
@@ -560,106 +1292,471 @@ pysander_pme_input(PyObject *self) {
  */
 static PyObject *
 pysander_natom(PyObject *self) {
+    int natom;
+
+    pysander_lock();
     if (IS_SETUP == 0) {
+        pysander_unlock();
         PyErr_SetString(PyExc_RuntimeError,
                         "Cannot query number of atoms -- no system set up");
         return NULL;
     }
+    natom = NATOM;
+    pysander_unlock();
 
-    return PyInt_FromLong((long int)sander_natom());
+    return PyInt_FromLong((long int)natom);
 }
 
-static PyObject *
-pysander_energy_forces(PyObject *self) {
+static PyObject*
+pysander_energy_forces(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"out", "soa", "atoms", NULL};
+    PyObject *out = Py_None, *pyatoms = Py_None;
+    pysander_coords_out forces;
+    Py_buffer atoms_view;
+    Py_ssize_t nsel;
+    double *full = NULL;
+    int soa = 0;
+    unsigned long long t_in = pysander_now(), t_call, t_out, copied = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OiO", kwlist, &out, &soa,
+                                     &pyatoms))
+        return NULL;
+
+    // sander fills in the energy struct embedded in the EnergyTerms directly
+    pysander_EnergyTerms *py_energies = (pysander_EnergyTerms *)
+            pysander_EnergyTermsType.tp_alloc(&pysander_EnergyTermsType, 0);
+    if (py_energies == NULL)
+        return NULL;
+
+    pysander_lock();
 
     if (IS_SETUP == 0) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
         PyErr_SetString(PyExc_RuntimeError,
                         "Cannot compute energies and forces -- no system set up");
         return NULL;
     }
 
-    pot_ene energies;
-    int natom3 = 3 * sander_natom();
-    double *forces = (double *) malloc(natom3*sizeof(double));
+    // With a subset of atoms, sander writes all forces into SCRATCH_FULL and
+    // only the selected ones are gathered into the output
+    nsel = NATOM;
+    if (pyatoms != Py_None) {
+        nsel = pysander_get_indices(pyatoms, NATOM, &atoms_view);
+        if (nsel < 0) {
+            pysander_unlock();
+            Py_DECREF(py_energies);
+            return NULL;
+        }
+        full = SCRATCH_FULL;
+    }
+
+    // Have sander write straight into the caller's buffer if one was given
+    // and it needs no conversion
+    if (pysander_coords_out_init(&forces, out, (int) nsel, soa, SCRATCH_OUT,
+                                 "out"))
+        goto error_atoms;
+
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    double *all = full ? full : forces.aos;
+    pysander_cache_key key;
+    int use_cache = pysander_cache_key_init(&key, NULL, NULL);
+    if (!use_cache || !pysander_cache_fetch(&key, &py_energies->energies, all)) {
+        energy_forces(&py_energies->energies, all);
+        if (use_cache)
+            pysander_cache_store(&key, &py_energies->energies, all);
+    }
+    t_out = pysander_now();
+    if (full)
+        pysander_gather_coords(full, &atoms_view, nsel, forces.aos);
+    pysander_coords_out_convert(&forces);
+    Py_END_ALLOW_THREADS
+
+    if (full)
+        PyBuffer_Release(&atoms_view);
+
+    // Now construct the return values, before the scratch memory is released
+    PyObject *py_forces = pysander_coords_out_finish(&forces, &copied);
+    pysander_unlock();
+    if (py_forces == NULL) {
+        Py_DECREF(py_energies);
+        return NULL;
+    }
+
+    PyObject *ret = PyTuple_New(2);
+    PyTuple_SET_ITEM(ret, 0, (PyObject *)py_energies);
+    PyTuple_SET_ITEM(ret, 1, py_forces);
+
+    pysander_stats_record(STAT_ENERGY_FORCES, t_in, t_call, t_out, 0, copied);
+    return ret;
+
+error_atoms:
+    pysander_unlock();
+    if (pyatoms != Py_None)
+        PyBuffer_Release(&atoms_view);
+    Py_DECREF(py_energies);
+    return NULL;
+}
+
+/* Sets the positions (and optionally the box) and computes energies and forces
+ * in a single call, which saves the fixed cost of entering the module, taking
+ * the lock and checking the set-up state three times for every step
+ */
+static PyObject *
+pysander_evaluate(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"positions", "box", "out", "soa", "atoms", NULL};
+    PyObject *pypositions, *pybox = Py_None, *out = Py_None, *pyatoms = Py_None;
+    Py_buffer positions_view, atoms_view;
+    pysander_coords_out forces;
+    Py_ssize_t nsel;
+    double *positions, *full = NULL;
+    double box[6];
+    int has_box = 0, soa = 0;
+    unsigned long long t_in = pysander_now(), t_call, t_out, copied = 0;
 
-    energy_forces(&energies, forces);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOiO", kwlist,
+                                     &pypositions, &pybox, &out, &soa,
+                                     &pyatoms))
+        return NULL;
 
-    // Now construct the return values
+    if (pybox != Py_None) {
+        if (!PyArg_ParseTuple(pybox, "dddddd", &box[0], &box[1], &box[2],
+                              &box[3], &box[4], &box[5])) {
+            PyErr_SetString(PyExc_TypeError,
+                            "box must be a tuple of 6 floats or None");
+            return NULL;
+        }
+        has_box = 1;
+    }
 
     pysander_EnergyTerms *py_energies = (pysander_EnergyTerms *)
-            PyObject_CallObject((PyObject *) &pysander_EnergyTermsType, NULL);
-    PyObject *py_forces = PyList_New(natom3);
-
-    py_energies->tot = PyFloat_FromDouble(energies.tot);
-    py_energies->vdw = PyFloat_FromDouble(energies.vdw);
-    py_energies->elec = PyFloat_FromDouble(energies.elec);
-    py_energies->gb = PyFloat_FromDouble(energies.gb);
-    py_energies->bond = PyFloat_FromDouble(energies.bond);
-    py_energies->angle = PyFloat_FromDouble(energies.angle);
-    py_energies->dihedral = PyFloat_FromDouble(energies.dihedral);
-    py_energies->vdw_14 = PyFloat_FromDouble(energies.vdw_14);
-    py_energies->elec_14 = PyFloat_FromDouble(energies.elec_14);
-    py_energies->constraint = PyFloat_FromDouble(energies.constraint);
-    py_energies->polar = PyFloat_FromDouble(energies.polar);
-    py_energies->hbond = PyFloat_FromDouble(energies.hbond);
-    py_energies->surf = PyFloat_FromDouble(energies.surf);
-    py_energies->scf = PyFloat_FromDouble(energies.scf);
-    py_energies->disp = PyFloat_FromDouble(energies.disp);
-    py_energies->dvdl = PyFloat_FromDouble(energies.dvdl);
-    py_energies->angle_ub = PyFloat_FromDouble(energies.angle_ub);
-    py_energies->imp = PyFloat_FromDouble(energies.imp);
-    py_energies->cmap = PyFloat_FromDouble(energies.cmap);
-    py_energies->emap = PyFloat_FromDouble(energies.emap);
-    py_energies->les = PyFloat_FromDouble(energies.les);
-    py_energies->noe = PyFloat_FromDouble(energies.noe);
-    py_energies->pb = PyFloat_FromDouble(energies.pb);
-    py_energies->rism = PyFloat_FromDouble(energies.rism);
-    py_energies->ct = PyFloat_FromDouble(energies.ct);
-    py_energies->amd_boost = PyFloat_FromDouble(energies.amd_boost);
-
-    Py_ssize_t i;
-    for (i = 0; i < (Py_ssize_t) natom3; i++)
-        PyList_SET_ITEM(py_forces, i, PyFloat_FromDouble(forces[i]));
-    free(forces);
+            pysander_EnergyTermsType.tp_alloc(&pysander_EnergyTermsType, 0);
+    if (py_energies == NULL)
+        return NULL;
+
+    pysander_lock();
+
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot compute energies and forces -- no system set up");
+        return NULL;
+    }
+
+    positions = pysander_get_coords(pypositions, NATOM, soa, SCRATCH_IN,
+                                    "positions", &positions_view);
+    if (positions == NULL) {
+        pysander_unlock();
+        Py_DECREF(py_energies);
+        return NULL;
+    }
+
+    nsel = NATOM;
+    if (pyatoms != Py_None) {
+        nsel = pysander_get_indices(pyatoms, NATOM, &atoms_view);
+        if (nsel < 0) {
+            pyatoms = Py_None;
+            goto error;
+        }
+        full = SCRATCH_FULL;
+    }
+
+    if (pysander_coords_out_init(&forces, out, (int) nsel, soa, SCRATCH_OUT,
+                                 "out"))
+        goto error;
+
+    POS_VALID = 0;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    if (has_box)
+        set_box(box[0], box[1], box[2], box[3], box[4], box[5]);
+    set_positions(positions);
+    double *all = full ? full : forces.aos;
+    pysander_cache_key key;
+    int use_cache = pysander_cache_key_init(&key, positions,
+                                            has_box ? box : NULL);
+    if (!use_cache || !pysander_cache_fetch(&key, &py_energies->energies, all)) {
+        energy_forces(&py_energies->energies, all);
+        if (use_cache)
+            pysander_cache_store(&key, &py_energies->energies, all);
+    }
+    t_out = pysander_now();
+    if (full)
+        pysander_gather_coords(full, &atoms_view, nsel, forces.aos);
+    pysander_coords_out_convert(&forces);
+    Py_END_ALLOW_THREADS
+
+    if (full)
+        PyBuffer_Release(&atoms_view);
+
+    unsigned long long copied_in = pysander_copied_bytes(&positions_view);
+    pysander_release_doubles(&positions_view);
+
+    PyObject *py_forces = pysander_coords_out_finish(&forces, &copied);
+    pysander_unlock();
+    if (py_forces == NULL) {
+        Py_DECREF(py_energies);
+        return NULL;
+    }
 
     PyObject *ret = PyTuple_New(2);
     PyTuple_SET_ITEM(ret, 0, (PyObject *)py_energies);
     PyTuple_SET_ITEM(ret, 1, py_forces);
 
+    pysander_stats_record(STAT_EVALUATE, t_in, t_call, t_out, copied_in,
+                          copied);
     return ret;
+
+error:
+    pysander_unlock();
+    if (pyatoms != Py_None)
+        PyBuffer_Release(&atoms_view);
+    pysander_release_doubles(&positions_view);
+    Py_DECREF(py_energies);
+    return NULL;
 }
 
+/* Evaluates energies (and optionally forces) for many frames in one call. The
+ * whole loop over set_box/set_positions/energy_forces runs in C with the GIL
+ * released. Frames are read from and results written to buffers supplied by
+ * the caller (the Python wrapper allocates them as numpy arrays)
+ */
 static PyObject *
-pysander_get_positions(PyObject *self) {
+pysander_energy_forces_batch(PyObject *self, PyObject *args) {
+
+    PyObject *pyframes, *pyboxes, *pyenergies, *pyforces;
+    Py_buffer frames_view, boxes_view, energies_view, forces_view;
+    double *frames, *boxes = NULL, *energies, *forces = NULL;
+    Py_ssize_t nframes, natom3, i;
+    unsigned long long t_in = pysander_now(), t_call, t_out;
+
+    if (!PyArg_ParseTuple(args, "OOOO", &pyframes, &pyboxes, &pyenergies,
+                          &pyforces))
+        return NULL;
+
+    pysander_lock();
 
     if (IS_SETUP == 0) {
+        pysander_unlock();
         PyErr_SetString(PyExc_RuntimeError,
-                        "Cannot get positions when no system is set up.");
+                        "Cannot compute energies and forces -- no system set up");
+        return NULL;
+    }
+
+    natom3 = 3 * (Py_ssize_t) NATOM;
+
+    frames = pysander_get_doubles(pyframes, -1, "frames", &frames_view);
+    if (frames == NULL) {
+        pysander_unlock();
         return NULL;
     }
+    nframes = frames_view.len / (Py_ssize_t) sizeof(double) / natom3;
+    if (nframes * natom3 * (Py_ssize_t) sizeof(double) != frames_view.len) {
+        PyErr_SetString(PyExc_ValueError,
+                        "frames must have nframes*natom*3 elements");
+        goto error;
+    }
+
+    if (pyboxes != Py_None) {
+        boxes = pysander_get_doubles(pyboxes, nframes * 6, "boxes",
+                                     &boxes_view);
+        if (boxes == NULL)
+            goto error;
+    }
+
+    energies = pysander_get_output_doubles(pyenergies,
+                        nframes * NUM_ENERGY_TERMS, "energies", &energies_view);
+    if (energies == NULL)
+        goto error;
+
+    if (pyforces != Py_None) {
+        forces = pysander_get_output_doubles(pyforces, nframes * natom3,
+                                             "forces", &forces_view);
+        if (forces == NULL) {
+            PyBuffer_Release(&energies_view);
+            goto error;
+        }
+    }
+
+    POS_VALID = 0;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    pot_ene ene;
+    for (i = 0; i < nframes; i++) {
+        if (boxes) {
+            double *box = boxes + 6 * i;
+            set_box(box[0], box[1], box[2], box[3], box[4], box[5]);
+        }
+        set_positions(frames + natom3 * i);
+        energy_forces(&ene, forces ? forces + natom3 * i : SCRATCH_FULL);
+        pysander_pot_ene_to_array(&ene, energies + NUM_ENERGY_TERMS * i);
+    }
+    Py_END_ALLOW_THREADS
+    t_out = pysander_now();
+
+    pysander_unlock();
+
+    unsigned long long copied = pysander_copied_bytes(&frames_view);
+    if (boxes)
+        copied += pysander_copied_bytes(&boxes_view);
+    if (forces)
+        PyBuffer_Release(&forces_view);
+    PyBuffer_Release(&energies_view);
+    if (boxes)
+        pysander_release_doubles(&boxes_view);
+    pysander_release_doubles(&frames_view);
+
+    pysander_stats_record(STAT_ENERGY_FORCES_BATCH, t_in, t_call, t_out,
+                          copied, 0);
+    return PyInt_FromLong((long int) nframes);
+
+error:
+    pysander_unlock();
+    if (boxes)
+        pysander_release_doubles(&boxes_view);
+    pysander_release_doubles(&frames_view);
+    return NULL;
+}
+
+static PyObject*
+pysander_get_positions(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"out", "soa", NULL};
+    PyObject *out = Py_None;
+    pysander_coords_out positions;
+    int soa = 0;
+    unsigned long long t_in = pysander_now(), t_call, t_out, copied = 0;
 
-    int natom3 = 3 * sander_natom();
-    double *positions = (double *) malloc(natom3*sizeof(double));
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Oi", kwlist, &out, &soa))
+        return NULL;
 
-    PyObject *py_positions = PyList_New(natom3);
+    pysander_lock();
 
-    get_positions(positions);
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot get positions when no system is set up.");
+        return NULL;
+    }
 
-    Py_ssize_t i;
-    for (i = 0; i < (Py_ssize_t) natom3; i++)
-        PyList_SET_ITEM(py_positions, i, PyFloat_FromDouble(positions[i]));
-    free(positions);
+    if (pysander_coords_out_init(&positions, out, NATOM, soa, SCRATCH_OUT,
+                                 "out")) {
+        pysander_unlock();
+        return NULL;
+    }
 
-    return py_positions;
+    t_call = pysander_now();
+    Py_BEGIN_ALLOW_THREADS
+    get_positions(positions.aos);
+    t_out = pysander_now();
+    pysander_coords_out_convert(&positions);
+    Py_END_ALLOW_THREADS
+
+    PyObject *ret = pysander_coords_out_finish(&positions, &copied);
+    pysander_unlock();
+    if (ret != NULL)
+        pysander_stats_record(STAT_GET_POSITIONS, t_in, t_call, t_out, 0,
+                              copied);
+    return ret;
 }
 
 static PyObject *
 pysander_is_setup(PyObject *self) {
-    if (IS_SETUP == 0)
+    int is_setup;
+
+    pysander_lock();
+    is_setup = IS_SETUP;
+    pysander_unlock();
+
+    if (is_setup == 0)
         Py_RETURN_FALSE;
     Py_RETURN_TRUE;
 }
 
+/* Cordion off the streaming trajectory evaluator and the native drivers, too.
+ * They are compiled as part of this file (and listed as dependencies in
+ * setup.py) because they use SANDER_LOCK, the module state and the buffer
+ * helpers defined above.
+ */
+#include "pysandertrajectory.c"
+
+// ... and the native minimizer
+#include "pysanderminimize.c"
+
+// ... and the native MD driver, with its random number generator
+#include "pysanderrandom.c"
+#include "pysanderdynamics.c"
+
+// ... and the per-group force reduction
+#include "pysandergroups.c"
+
+// ... and the Monte Carlo driver
+#include "pysandermc.c"
+
+static PyObject *
+pysander_setup_count(PyObject *self) {
+    long count;
+
+    pysander_lock();
+    count = SETUP_COUNT;
+    pysander_unlock();
+
+    return PyInt_FromLong(count);
+}
+
+static PyObject *
+pysander_stats(PyObject *self) {
+    static const char *time_names[3] = {"marshal_in", "sander", "marshal_out"};
+    char key[32];
+    PyObject *ret = PyDict_New();
+    int i, j;
+
+    if (ret == NULL)
+        return NULL;
+
+    for (i = 0; i < NUM_STATS; i++) {
+        pysander_stat *stat = &STATS[i];
+        PyObject *entry = PyDict_New(), *val;
+        if (entry == NULL || PyDict_SetItemString(ret, pysander_stat_names[i],
+                                                  entry) < 0) {
+            Py_XDECREF(entry);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(entry);
+#define SET_STAT(name, pyval) \
+        val = pyval; \
+        if (val == NULL || PyDict_SetItemString(entry, name, val) < 0) { \
+            Py_XDECREF(val); \
+            Py_DECREF(ret); \
+            return NULL; \
+        } \
+        Py_DECREF(val);
+        SET_STAT("calls", PyLong_FromUnsignedLongLong(stat->calls));
+        for (j = 0; j < 3; j++) {
+            snprintf(key, sizeof(key), "%s_time", time_names[j]);
+            SET_STAT(key, PyFloat_FromDouble(stat->ns[j] * 1e-9));
+            snprintf(key, sizeof(key), "%s_max", time_names[j]);
+            SET_STAT(key, PyFloat_FromDouble(stat->max_ns[j] * 1e-9));
+        }
+        SET_STAT("bytes_in", PyLong_FromUnsignedLongLong(stat->bytes_in));
+        SET_STAT("bytes_out", PyLong_FromUnsignedLongLong(stat->bytes_out));
+#undef SET_STAT
+    }
+
+    return ret;
+}
+
+static PyObject *
+pysander_reset_stats(PyObject *self) {
+    memset(STATS, 0, sizeof(STATS));
+    Py_RETURN_NONE;
+}
+
 /* Python module initialization */
 
 static PyMethodDef
@@ -677,9 +1774,56 @@ pysanderMethods[] = {
             "defaults for PME calculations.\n"},
     { "natom", (PyCFunction) pysander_natom, METH_NOARGS,
             "Returns the number of atoms in the currently set-up system"},
-    { "energy_forces", (PyCFunction) pysander_energy_forces, METH_NOARGS,
+    { "energy_forces", (PyCFunction) pysander_energy_forces,
+            METH_VARARGS | METH_KEYWORDS,
             "Computes energies and forces from the given set of coordinates.\n"
             "\n"
+            "Parameters\n"
+            "----------\n"
+            "   out : writable float64 or float32 buffer, optional\n"
+            "       C-contiguous buffer of 3*natom elements that the forces are\n"
+            "       written into (no list is built). float64 output in the\n"
+            "       default layout is written by sander directly\n"
+            "   soa : int, optional\n"
+            "       If nonzero, forces are stored as all x, then all y, then\n"
+            "       all z components instead of x, y, z of each atom\n"
+            "   atoms : int32 or int64 buffer, optional\n"
+            "       Indices of the atoms whose forces are returned (out then\n"
+            "       holds 3*len(atoms) elements). Default is all atoms\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   energy : type EnergyTerms\n"
+            "       An EnergyTerms instance populated with the energy components\n"
+            "       in kilocalories per mole\n"
+            "\n"
+            "   forces : list\n"
+            "       A list of all forces in kilocalories/mole/Angstroms (or out,\n"
+            "       if it was given)"},
+    { "evaluate", (PyCFunction) pysander_evaluate,
+            METH_VARARGS | METH_KEYWORDS,
+            "Sets the positions (and box) and computes energies and forces in\n"
+            "a single call.\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   positions : float64/float32 buffer or list of 3*natom floats\n"
+            "       The new atomic positions in Angstroms (in the SoA layout\n"
+            "       if soa is set)\n"
+            "   box : tuple of 6 floats, optional\n"
+            "       a, b, c, alpha, beta, gamma of the new unit cell. If None,\n"
+            "       the box is left unchanged\n"
+            "   out : writable float64 or float32 buffer, optional\n"
+            "       C-contiguous buffer of 3*natom elements that the forces are\n"
+            "       written into (no list is built). float64 output in the\n"
+            "       default layout is written by sander directly\n"
+            "   soa : int, optional\n"
+            "       If nonzero, forces are stored as all x, then all y, then\n"
+            "       all z components instead of x, y, z of each atom\n"
+            "   atoms : int32 or int64 buffer, optional\n"
+            "       Indices of the atoms whose forces are returned (out then\n"
+            "       holds 3*len(atoms) elements). Default is all atoms\n"
+            "\n"
             "Returns\n"
             "-------\n"
             "   energy : type EnergyTerms\n"
@@ -687,11 +1831,169 @@ pysanderMethods[] = {
             "       in kilocalories per mole\n"
             "\n"
             "   forces : list\n"
-            "       A list of all forces in kilocalories/mole/Angstroms"},
+            "       A list of all forces in kilocalories/mole/Angstroms (or out,\n"
+            "       if it was given)"},
+    { "minimize", (PyCFunction) pysander_minimize,
+            METH_VARARGS | METH_KEYWORDS,
+            "Minimizes the energy of the active system (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   positions : writable float64 buffer of 3*natom elements\n"
+            "       The starting structure, overwritten by the final one\n"
+            "   frozen : buffer of natom bytes, optional\n"
+            "       Nonzero for atoms that are not allowed to move\n"
+            "   method : int\n"
+            "       0 for L-BFGS (falling back to FIRE) or 1 for FIRE\n"
+            "   maxiter : int\n"
+            "   rms_force, max_force : float\n"
+            "       Convergence thresholds in kcal/mol/Angstrom\n"
+            "   max_step : float\n"
+            "       Largest displacement of any coordinate in a step\n"
+            "   memory : int\n"
+            "       Number of L-BFGS correction pairs\n"
+            "   log : writable float64 buffer of (maxiter+1)*5 elements\n"
+            "       Receives energy, RMS force, max force, step and method\n"
+            "       for the start and every iteration\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   energy, niter, status, nevals : EnergyTerms, int, int, int\n"
+            "       status is 0 if converged and 1 if maxiter was reached"},
+    { "dynamics", (PyCFunction) pysander_dynamics,
+            METH_VARARGS | METH_KEYWORDS,
+            "Runs velocity Verlet/Langevin dynamics (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   positions, velocities : writable float64 buffers of 3*natom\n"
+            "       The starting state (Angstroms, Angstroms/ps), overwritten\n"
+            "       by the final one\n"
+            "   masses : float64 buffer of natom elements (amu)\n"
+            "   nsteps : int\n"
+            "   dt : float\n"
+            "       Time step in ps\n"
+            "   temperature : float\n"
+            "       Thermostat (and initial velocity) temperature in K\n"
+            "   gamma : float\n"
+            "       Langevin friction in 1/ps (0 for NVE)\n"
+            "   seed : int\n"
+            "   nwrite : int\n"
+            "       Output is written every nwrite steps\n"
+            "   frames, energies, kinetic : writable float64 buffers\n"
+            "       nframes*3*natom, nframes*nterms and nframes elements (or\n"
+            "       None), where nframes = nsteps // nwrite\n"
+            "   init_velocities : int\n"
+            "       If nonzero, velocities are drawn from the Maxwell-\n"
+            "       Boltzmann distribution at temperature first\n"
+            "   frozen : buffer of natom bytes, optional\n"
+            "       Nonzero for atoms that are not allowed to move\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   energy, nframes : EnergyTerms, int\n"
+            "       The energy of the last step and the number of frames\n"
+            "       written"},
+    { "set_groups", (PyCFunction) pysander_set_groups, METH_VARARGS,
+            "Registers atom groups for energy_forces_groups (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   groups : int32 or int64 buffer of natom elements\n"
+            "       The 1-based group number of every atom (0 for atoms that\n"
+            "       belong to no group)\n"
+            "   masses : float64 buffer of natom elements\n"
+            "       Weights of the atoms in the group centers of mass\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   ngroups : int\n"
+            "       The number of groups (the largest group number)"},
+    { "energy_forces_groups", (PyCFunction) pysander_energy_forces_groups,
+            METH_VARARGS,
+            "Computes energies and per-group forces and torques (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   forces, torques : writable float64 buffers of 3*ngroups\n"
+            "       Receive the net force on every group and the torque about\n"
+            "       its center of mass\n"
+            "   com : writable float64 buffer of 3*ngroups, optional\n"
+            "       Receives the center of mass of every group\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   energy : EnergyTerms"},
+    { "monte_carlo", (PyCFunction) pysander_monte_carlo,
+            METH_VARARGS | METH_KEYWORDS,
+            "Runs Metropolis Monte Carlo (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   positions : writable float64 buffer of 3*natom elements\n"
+            "       The starting structure, overwritten by the final one\n"
+            "   types : int buffer of nmoves elements\n"
+            "       0 (translation), 1 (rotation) or 2 (torsion) per move\n"
+            "   sizes : float64 buffer of nmoves elements\n"
+            "       Largest displacement (Angstroms) or angle (radians)\n"
+            "   axes : int buffer of 2*nmoves elements\n"
+            "       The two atoms defining the bond of torsion moves\n"
+            "   starts : int buffer of nmoves+1 elements\n"
+            "       Move m moves the atoms atoms[starts[m]:starts[m+1]]\n"
+            "   atoms : int buffer of atom indices\n"
+            "   nsteps : int\n"
+            "   temperature : float\n"
+            "       In K\n"
+            "   seed : int\n"
+            "   nwrite : int\n"
+            "       Output is written every nwrite steps\n"
+            "   frames, energies : writable float64 buffers\n"
+            "       nframes*3*natom and nframes*nterms elements (or None),\n"
+            "       where nframes = nsteps // nwrite\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   energy, nframes, attempted, accepted : EnergyTerms, int,\n"
+            "           list, list\n"
+            "       The energy of the final structure, the number of frames\n"
+            "       written, and how often each move was tried and accepted"},
+    { "energy_forces_batch", (PyCFunction) pysander_energy_forces_batch,
+            METH_VARARGS,
+            "Computes energies and forces for many frames (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   frames : float64 buffer with nframes*natom*3 elements\n"
+            "   boxes : float64 buffer with nframes*6 elements, or None\n"
+            "   energies : writable float64 buffer with nframes*nterms elements\n"
+            "   forces : writable float64 buffer with nframes*natom*3 elements,\n"
+            "            or None if forces are not needed\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   nframes : int\n"
+            "       The number of frames that were evaluated"},
     { "set_positions", (PyCFunction) pysander_set_positions, METH_VARARGS,
-            "Sets the active positions to the passed list of positions (private)"},
-    { "get_positions", (PyCFunction) pysander_get_positions, METH_NOARGS,
-            "Returns the currently active positions as a list"},
+            "Sets the active positions to the passed list of positions or\n"
+            "C-contiguous float64 or float32 buffer of 3*natom elements. If\n"
+            "the optional second argument is nonzero, the positions are all\n"
+            "x, then all y, then all z coordinates (private)"},
+    { "update_positions", (PyCFunction) pysander_update_positions,
+            METH_VARARGS,
+            "Moves a subset of the atoms (private).\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   indices : int32 or int64 buffer of n atom indices\n"
+            "   coords : list or float64 or float32 buffer of 3*n elements\n"
+            "       The new positions of those atoms"},
+    { "get_positions", (PyCFunction) pysander_get_positions,
+            METH_VARARGS | METH_KEYWORDS,
+            "Returns the currently active positions as a list. If a writable,\n"
+            "C-contiguous float64 or float32 buffer of 3*natom elements is\n"
+            "passed as out, the positions are written into it and it is\n"
+            "returned instead. If soa is nonzero, all x, then all y, then all\n"
+            "z coordinates are returned"},
     { "set_box", (PyCFunction) pysander_set_box, METH_VARARGS,
             "Sets the box dimensions of the active system.\n"
             "\n"
@@ -718,6 +2020,39 @@ pysanderMethods[] = {
             "    Unit cell dimensions and angles between the vectors\n"},
     { "is_setup", (PyCFunction) pysander_is_setup, METH_NOARGS,
             "Returns True if sander is set up and False otherwise"},
+    { "setup_count", (PyCFunction) pysander_setup_count, METH_NOARGS,
+            "Returns the number of times a system has been set up in this\n"
+            "process, which changes every time the active system is replaced"},
+    { "set_cache", (PyCFunction) pysander_set_cache, METH_VARARGS,
+            "Configures the result cache of energy_forces and evaluate.\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   size : int\n"
+            "       The number of results kept (0 disables the cache)\n"
+            "   tolerance : float, optional\n"
+            "       A stored result is reused if no coordinate (or box\n"
+            "       dimension) differs by more than this. 0 (default)\n"
+            "       requires an exact match"},
+    { "clear_cache", (PyCFunction) pysander_clear_cache, METH_NOARGS,
+            "Drops all cached results and resets the hit and miss counts"},
+    { "cache_info", (PyCFunction) pysander_cache_info, METH_NOARGS,
+            "Returns a dict with the size, tolerance, number of entries,\n"
+            "hits and misses of the result cache"},
+    { "stats", (PyCFunction) pysander_stats, METH_NOARGS,
+            "Returns timing and data-movement counters for each entry point.\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "stats : dict\n"
+            "    Maps each entry point name to a dict with the number of\n"
+            "    successful calls, the total and maximum time in seconds\n"
+            "    spent converting the arguments (marshal_in, which includes\n"
+            "    waiting for other threads), in sander (sander) and building\n"
+            "    the results (marshal_out), and the number of bytes of\n"
+            "    coordinate data copied in (bytes_in) and out (bytes_out)\n"},
+    { "reset_stats", (PyCFunction) pysander_reset_stats, METH_NOARGS,
+            "Resets all counters returned by stats to zero"},
     {NULL}, // sentinel
 };
 
@@ -738,6 +2073,11 @@ static struct PyModuleDef moduledef = {
 #if PY_MAJOR_VERSION >= 3
 PyMODINIT_FUNC
 PyInit_pysander(void) {
+    SANDER_LOCK = PyThread_allocate_lock();
+    if (SANDER_LOCK == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not allocate sander lock");
+        return NULL;
+    }
     // Type declarations
     if (PyType_Ready(&pysander_InputOptionsType) < 0)
         return NULL;
@@ -745,16 +2085,25 @@ PyInit_pysander(void) {
         return NULL;
     if (PyType_Ready(&pysander_QmInputOptionsType) < 0)
         return NULL;
+    if (PyType_Ready(&pysander_TrajectoryType) < 0)
+        return NULL;
     PyObject* m = PyModule_Create(&moduledef);
 #else
 PyMODINIT_FUNC
 initpysander(void) {
+    SANDER_LOCK = PyThread_allocate_lock();
+    if (SANDER_LOCK == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not allocate sander lock");
+        return;
+    }
     if (PyType_Ready(&pysander_InputOptionsType))
         return;
     if (PyType_Ready(&pysander_EnergyTermsType))
         return;
     if (PyType_Ready(&pysander_QmInputOptionsType))
         return;
+    if (PyType_Ready(&pysander_TrajectoryType))
+        return;
     PyObject* m = Py_InitModule3("pysander", pysanderMethods,
                 "Python interface into sander energy and force evaluation");
 #endif
@@ -766,6 +2115,19 @@ initpysander(void) {
     PyModule_AddObject(m, "EnergyTerms", (PyObject *) &pysander_EnergyTermsType);
     Py_INCREF(&pysander_QmInputOptionsType);
     PyModule_AddObject(m, "QmInputOptions", (PyObject *) &pysander_QmInputOptionsType);
+    Py_INCREF(&pysander_TrajectoryType);
+    PyModule_AddObject(m, "Trajectory", (PyObject *) &pysander_TrajectoryType);
+
+    // The order of the columns in batched energy arrays
+    PyObject *terms = PyTuple_New(NUM_ENERGY_TERMS);
+    int i;
+    for (i = 0; i < NUM_ENERGY_TERMS; i++)
+#if PY_MAJOR_VERSION >= 3
+        PyTuple_SET_ITEM(terms, i, PyUnicode_FromString(pysander_energy_terms[i]));
+#else
+        PyTuple_SET_ITEM(terms, i, PyString_FromString(pysander_energy_terms[i]));
+#endif
+    PyModule_AddObject(m, "ENERGY_TERMS", terms);
 
 #if PY_MAJOR_VERSION >= 3
     return m;
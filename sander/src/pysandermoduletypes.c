@@ -214,160 +214,163 @@ static PyTypeObject pysander_InputOptionsType = {
 
 };
 
-// Energy struct
+/* The energy terms in the order they are laid out in flat energy arrays (e.g.,
+ * the rows filled by energy_forces_batch). This is the same order as the
+ * members of the pot_ene struct
+ */
+#define NUM_ENERGY_TERMS 26
+
+static const char *pysander_energy_terms[NUM_ENERGY_TERMS] = {
+    "tot", "vdw", "elec", "gb", "bond", "angle", "dihedral", "vdw_14",
+    "elec_14", "constraint", "polar", "hbond", "surf", "scf", "disp", "dvdl",
+    "angle_ub", "imp", "cmap", "emap", "les", "noe", "pb", "rism", "ct",
+    "amd_boost"
+};
+
+// Copies the energy terms into arr in the order of pysander_energy_terms
+static void
+pysander_pot_ene_to_array(const pot_ene *energies, double *arr) {
+    arr[0] = energies->tot;
+    arr[1] = energies->vdw;
+    arr[2] = energies->elec;
+    arr[3] = energies->gb;
+    arr[4] = energies->bond;
+    arr[5] = energies->angle;
+    arr[6] = energies->dihedral;
+    arr[7] = energies->vdw_14;
+    arr[8] = energies->elec_14;
+    arr[9] = energies->constraint;
+    arr[10] = energies->polar;
+    arr[11] = energies->hbond;
+    arr[12] = energies->surf;
+    arr[13] = energies->scf;
+    arr[14] = energies->disp;
+    arr[15] = energies->dvdl;
+    arr[16] = energies->angle_ub;
+    arr[17] = energies->imp;
+    arr[18] = energies->cmap;
+    arr[19] = energies->emap;
+    arr[20] = energies->les;
+    arr[21] = energies->noe;
+    arr[22] = energies->pb;
+    arr[23] = energies->rism;
+    arr[24] = energies->ct;
+    arr[25] = energies->amd_boost;
+}
+
+// Energy struct. The energies are stored in the sander struct itself
 typedef struct {
     PyObject_HEAD
-    PyObject *tot;
-    PyObject *vdw;
-    PyObject *elec;
-    PyObject *gb;
-    PyObject *bond;
-    PyObject *angle;
-    PyObject *dihedral;
-    PyObject *vdw_14;
-    PyObject *elec_14;
-    PyObject *constraint;
-    PyObject *polar;
-    PyObject *hbond;
-    PyObject *surf;
-    PyObject *scf;
-    PyObject *disp;
-    PyObject *dvdl;
-    PyObject *angle_ub;
-    PyObject *imp;
-    PyObject *cmap;
-    PyObject *emap;
-    PyObject *les;
-    PyObject *noe;
-    PyObject *pb;
-    PyObject *rism;
-    PyObject *ct;
-    PyObject *amd_boost;
+    pot_ene energies;
 } pysander_EnergyTerms;
 
-#define ASSIGN(var) self->var = PyFloat_FromDouble(0.0)
+// The buffer interface relies on pot_ene being a plain array of doubles
+typedef char pysander_pot_ene_size_check[
+        sizeof(pot_ene) == NUM_ENERGY_TERMS * sizeof(double) ? 1 : -1];
 
 static PyObject *
 pysander_EnergyTerms_new(PyTypeObject *type) {
-    pysander_EnergyTerms *self;
-    self = (pysander_EnergyTerms *)type->tp_alloc(type, 0);
-    if (self != NULL) {
-        ASSIGN(tot);
-        ASSIGN(vdw);
-        ASSIGN(elec);
-        ASSIGN(gb);
-        ASSIGN(bond);
-        ASSIGN(angle);
-        ASSIGN(dihedral);
-        ASSIGN(vdw_14);
-        ASSIGN(elec_14);
-        ASSIGN(constraint);
-        ASSIGN(polar);
-        ASSIGN(hbond);
-        ASSIGN(surf);
-        ASSIGN(scf);
-        ASSIGN(disp);
-        ASSIGN(dvdl);
-        ASSIGN(angle_ub);
-        ASSIGN(imp);
-        ASSIGN(cmap);
-        ASSIGN(emap);
-        ASSIGN(les);
-        ASSIGN(noe);
-        ASSIGN(pb);
-        ASSIGN(rism);
-        ASSIGN(ct);
-        ASSIGN(amd_boost);
-    }
-
-    return (PyObject *) self;
+    // tp_alloc zero-fills the instance, so all energies start out as 0
+    return type->tp_alloc(type, 0);
 }
 
-#undef ASSIGN
-
 static void
 pysander_EnergyTerms_dealloc(pysander_EnergyTerms* self) {
-    Py_DECREF(self->tot);
-    Py_DECREF(self->vdw);
-    Py_DECREF(self->elec);
-    Py_DECREF(self->gb);
-    Py_DECREF(self->bond);
-    Py_DECREF(self->angle);
-    Py_DECREF(self->dihedral);
-    Py_DECREF(self->vdw_14);
-    Py_DECREF(self->elec_14);
-    Py_DECREF(self->constraint);
-    Py_DECREF(self->polar);
-    Py_DECREF(self->hbond);
-    Py_DECREF(self->surf);
-    Py_DECREF(self->scf);
-    Py_DECREF(self->disp);
-    Py_DECREF(self->dvdl);
-    Py_DECREF(self->angle_ub);
-    Py_DECREF(self->imp);
-    Py_DECREF(self->cmap);
-    Py_DECREF(self->emap);
-    Py_DECREF(self->les);
-    Py_DECREF(self->noe);
-    Py_DECREF(self->pb);
-    Py_DECREF(self->rism);
-    Py_DECREF(self->ct);
-    Py_DECREF(self->amd_boost);
     PY_DESTROY_TYPE;
 }
 
+/* Exposes the energies as a 1-D float64 array of NUM_ENERGY_TERMS elements */
+static int
+pysander_EnergyTerms_getbuffer(pysander_EnergyTerms *self, Py_buffer *view,
+                               int flags) {
+    static Py_ssize_t shape[1] = {NUM_ENERGY_TERMS};
+    static Py_ssize_t strides[1] = {sizeof(double)};
+
+    view->buf = &self->energies;
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->len = sizeof(pot_ene);
+    view->readonly = 0;
+    view->itemsize = sizeof(double);
+    view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static PyBufferProcs pysander_EnergyTermsBuffer = {
+    (getbufferproc) pysander_EnergyTerms_getbuffer, // bf_getbuffer
+    0,                                              // bf_releasebuffer
+};
+#   define PYSANDER_BUFFER_FLAGS Py_TPFLAGS_DEFAULT
+#else
+static PyBufferProcs pysander_EnergyTermsBuffer = {
+    0,                                              // bf_getreadbuffer
+    0,                                              // bf_getwritebuffer
+    0,                                              // bf_getsegcount
+    0,                                              // bf_getcharbuffer
+    (getbufferproc) pysander_EnergyTerms_getbuffer, // bf_getbuffer
+    0,                                              // bf_releasebuffer
+};
+#   define PYSANDER_BUFFER_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#endif
+
 static PyMemberDef pysander_EnergyTermsMembers[] = {
-    {"tot", T_OBJECT_EX, offsetof(pysander_EnergyTerms, tot), 0,
+    {"tot", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.tot), 0,
                 "Total potential energy"},
-    {"vdw", T_OBJECT_EX, offsetof(pysander_EnergyTerms, vdw), 0,
+    {"vdw", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.vdw), 0,
                 "van der Waals energy (excluding 1-4)"},
-    {"elec", T_OBJECT_EX, offsetof(pysander_EnergyTerms, elec), 0,
+    {"elec", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.elec), 0,
                 "Electrostatic energy (excluding 1-4)"},
-    {"gb", T_OBJECT_EX, offsetof(pysander_EnergyTerms, gb), 0,
+    {"gb", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.gb), 0,
                 "Generalized Born polar solvation energy"},
-    {"bond", T_OBJECT_EX, offsetof(pysander_EnergyTerms, bond), 0,
+    {"bond", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.bond), 0,
                 "Bond energy"},
-    {"angle", T_OBJECT_EX, offsetof(pysander_EnergyTerms, angle), 0,
+    {"angle", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.angle), 0,
                 "Angle energy"},
-    {"dihedral", T_OBJECT_EX, offsetof(pysander_EnergyTerms, dihedral), 0,
+    {"dihedral", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.dihedral), 0,
                 "Dihedral energy (including impropers)"},
-    {"vdw_14", T_OBJECT_EX, offsetof(pysander_EnergyTerms, vdw_14), 0,
+    {"vdw_14", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.vdw_14), 0,
                 "1-4 van der Waals energy"},
-    {"elec_14", T_OBJECT_EX, offsetof(pysander_EnergyTerms, elec_14), 0,
+    {"elec_14", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.elec_14), 0,
                 "1-4 electrostatic energy"},
-    {"constraint", T_OBJECT_EX, offsetof(pysander_EnergyTerms, constraint), 0,
+    {"constraint", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.constraint), 0,
                 "Restraint energy"},
-    {"polar", T_OBJECT_EX, offsetof(pysander_EnergyTerms, polar), 0,
+    {"polar", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.polar), 0,
                 "Polarization energy (for polarized force fields)"},
-    {"hbond", T_OBJECT_EX, offsetof(pysander_EnergyTerms, hbond), 0,
+    {"hbond", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.hbond), 0,
                 "Hydrogen bond (10-12 potential) energy"},
-    {"surf", T_OBJECT_EX, offsetof(pysander_EnergyTerms, surf), 0,
+    {"surf", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.surf), 0,
                 "Nonpolar solvation energy for implicit solvent"},
-    {"scf", T_OBJECT_EX, offsetof(pysander_EnergyTerms, scf), 0,
+    {"scf", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.scf), 0,
                 "QM energy"},
-    {"disp", T_OBJECT_EX, offsetof(pysander_EnergyTerms, disp), 0,
+    {"disp", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.disp), 0,
                 "Dispersion nonpolar solvation energy from PB"},
-    {"dvdl", T_OBJECT_EX, offsetof(pysander_EnergyTerms, dvdl), 0,
+    {"dvdl", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.dvdl), 0,
                 "DV/DL from TI"},
-    {"angle_ub", T_OBJECT_EX, offsetof(pysander_EnergyTerms, angle_ub), 0,
+    {"angle_ub", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.angle_ub), 0,
                 "Urey-Bradley energy (CHARMM FF only)"},
-    {"imp", T_OBJECT_EX, offsetof(pysander_EnergyTerms, imp), 0,
+    {"imp", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.imp), 0,
                 "Improper torsion energy (CHARMM FF only)"},
-    {"cmap", T_OBJECT_EX, offsetof(pysander_EnergyTerms, cmap), 0,
+    {"cmap", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.cmap), 0,
                 "Coupled torsion correction map energy (CHARMM only)"},
-    {"emap", T_OBJECT_EX, offsetof(pysander_EnergyTerms, emap), 0,
+    {"emap", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.emap), 0,
                 "Energy map restraint energy"},
-    {"les", T_OBJECT_EX, offsetof(pysander_EnergyTerms, les), 0,
+    {"les", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.les), 0,
                 "LES energy"},
-    {"noe", T_OBJECT_EX, offsetof(pysander_EnergyTerms, noe), 0,
+    {"noe", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.noe), 0,
                 "NOE restraint energy"},
-    {"pb", T_OBJECT_EX, offsetof(pysander_EnergyTerms, pb), 0,
+    {"pb", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.pb), 0,
                 "PB polar solvation energy"},
-    {"rism", T_OBJECT_EX, offsetof(pysander_EnergyTerms, rism), 0,
+    {"rism", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.rism), 0,
                 "3D-RISM energy"},
-    {"ct", T_OBJECT_EX, offsetof(pysander_EnergyTerms, ct), 0,
+    {"ct", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.ct), 0,
                 "Charge-transfer energy (from charge-relocation module)"},
-    {"amd_boost", T_OBJECT_EX, offsetof(pysander_EnergyTerms, amd_boost), 0,
+    {"amd_boost", T_DOUBLE, offsetof(pysander_EnergyTerms, energies.amd_boost), 0,
                 "accelerated MD boost energy"},
     {NULL} /* sentinel */
 };
@@ -396,9 +399,11 @@ static PyTypeObject pysander_EnergyTermsType = {
     0,                              // tp_str
     0,                              // tp_getattro
     0,                              // tp_setattro
-    0,                              // tp_as_buffer
-    Py_TPFLAGS_DEFAULT,             // tp_flags
-    "List of sander energy terms",  // tp_doc
+    &pysander_EnergyTermsBuffer,    // tp_as_buffer
+    PYSANDER_BUFFER_FLAGS,          // tp_flags
+    "List of sander energy terms. Supports the buffer protocol, so\n"
+    "numpy.asarray(terms) is a float64 view of all terms in the order\n"
+    "given by ENERGY_TERMS", // tp_doc
     0,		                        // tp_traverse
     0,		                        // tp_clear
     0,		                        // tp_richcompare
@@ -0,0 +1,77 @@
+/* A small, fast pseudo-random number generator (xoshiro256**, seeded through
+ * splitmix64) for the native sampling drivers. Each driver owns its generator
+ * state, so runs are reproducible for a given seed regardless of what else
+ * happens in the process.
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t s[4];
+    int has_spare;      // Whether spare holds an unused normal deviate
+    double spare;
+} pysander_rng;
+
+static uint64_t
+pysander_splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void
+pysander_rng_seed(pysander_rng *rng, uint64_t seed) {
+    int i;
+    for (i = 0; i < 4; i++)
+        rng->s[i] = pysander_splitmix64(&seed);
+    rng->has_spare = 0;
+}
+
+static inline uint64_t
+pysander_rotl(const uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t
+pysander_rng_next(pysander_rng *rng) {
+    uint64_t *s = rng->s;
+    const uint64_t result = pysander_rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = pysander_rotl(s[3], 45);
+
+    return result;
+}
+
+// Uniform deviate in [0, 1)
+static double
+pysander_rng_uniform(pysander_rng *rng) {
+    return (pysander_rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Standard normal deviate (Marsaglia polar method)
+static double
+pysander_rng_gauss(pysander_rng *rng) {
+    double u, v, r;
+
+    if (rng->has_spare) {
+        rng->has_spare = 0;
+        return rng->spare;
+    }
+    do {
+        u = 2.0 * pysander_rng_uniform(rng) - 1.0;
+        v = 2.0 * pysander_rng_uniform(rng) - 1.0;
+        r = u * u + v * v;
+    } while (r >= 1.0 || r == 0.0);
+    r = sqrt(-2.0 * log(r) / r);
+    rng->spare = v * r;
+    rng->has_spare = 1;
+    return u * r;
+}
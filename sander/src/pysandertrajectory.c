@@ -0,0 +1,485 @@
+/* Streaming trajectory evaluation. A Trajectory reads frames from an Amber
+ * NetCDF or ASCII mdcrd trajectory file in fixed-size chunks and evaluates
+ * energies and forces for each chunk in C, so memory use is independent of the
+ * trajectory length.
+ */
+
+#include <netcdf.h>
+
+#define TRAJ_NETCDF 0
+#define TRAJ_MDCRD 1
+
+typedef struct {
+    PyObject_HEAD
+    int format;         // TRAJ_NETCDF or TRAJ_MDCRD
+    int natom;          // Number of atoms in each frame
+    long setup_count;   // SETUP_COUNT of the system the file was opened for
+    int has_box;        // Whether frames carry box information
+    Py_ssize_t chunk_size; // Maximum number of frames read at once
+    Py_ssize_t frame;   // Index of the next frame to read
+    Py_ssize_t nframes; // Total number of frames (-1 if unknown, for mdcrd)
+    double *coords;     // chunk_size*natom*3 coordinate buffer
+    double *boxes;      // chunk_size*6 box buffer
+    double *cell;       // chunk_size*6 buffer for NetCDF cell lengths/angles
+    double angles[3];   // Box angles for mdcrd files (which only store lengths)
+    // NetCDF state
+    int ncid;
+    int coord_id;
+    int length_id;
+    int angle_id;
+    // mdcrd state
+    FILE *fp;
+} pysander_Trajectory;
+
+static void
+pysander_Trajectory_close_file(pysander_Trajectory *self) {
+    if (self->format == TRAJ_NETCDF && self->ncid >= 0) {
+        nc_close(self->ncid);
+        self->ncid = -1;
+    } else if (self->format == TRAJ_MDCRD && self->fp != NULL) {
+        fclose(self->fp);
+        self->fp = NULL;
+    }
+}
+
+static int
+pysander_Trajectory_is_open(const pysander_Trajectory *self) {
+    if (self->format == TRAJ_NETCDF)
+        return self->ncid >= 0;
+    return self->fp != NULL;
+}
+
+static void
+pysander_Trajectory_dealloc(pysander_Trajectory *self) {
+    pysander_Trajectory_close_file(self);
+    free(self->coords);
+    free(self->boxes);
+    free(self->cell);
+    PY_DESTROY_TYPE;
+}
+
+/* Opens an Amber NetCDF trajectory. Returns 0 on success and sets a Python
+ * exception and returns 1 on failure
+ */
+static int
+pysander_Trajectory_open_netcdf(pysander_Trajectory *self, const char *fname) {
+    int err, dimid;
+    size_t len;
+
+    if ((err = nc_open(fname, NC_NOWRITE, &self->ncid)) != NC_NOERR) {
+        self->ncid = -1;
+        PyErr_Format(PyExc_IOError, "Could not open %s: %s", fname,
+                     nc_strerror(err));
+        return 1;
+    }
+    if (nc_inq_dimid(self->ncid, "atom", &dimid) != NC_NOERR ||
+            nc_inq_dimlen(self->ncid, dimid, &len) != NC_NOERR) {
+        PyErr_Format(PyExc_ValueError, "%s has no atom dimension", fname);
+        return 1;
+    }
+    if ((int) len != self->natom) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s has %d atoms, but the active system has %d",
+                     fname, (int) len, self->natom);
+        return 1;
+    }
+    if (nc_inq_dimid(self->ncid, "frame", &dimid) != NC_NOERR ||
+            nc_inq_dimlen(self->ncid, dimid, &len) != NC_NOERR) {
+        PyErr_Format(PyExc_ValueError, "%s has no frame dimension", fname);
+        return 1;
+    }
+    self->nframes = (Py_ssize_t) len;
+    if (nc_inq_varid(self->ncid, "coordinates", &self->coord_id) != NC_NOERR) {
+        PyErr_Format(PyExc_ValueError, "%s has no coordinates", fname);
+        return 1;
+    }
+    if (nc_inq_varid(self->ncid, "cell_lengths", &self->length_id) != NC_NOERR ||
+            nc_inq_varid(self->ncid, "cell_angles", &self->angle_id) != NC_NOERR) {
+        self->length_id = -1;
+        self->angle_id = -1;
+    }
+    self->has_box = self->length_id >= 0;
+
+    return 0;
+}
+
+static PyObject *
+pysander_Trajectory_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+
+    static char *kwlist[] = {"filename", "format", "chunk_size", "has_box",
+                             NULL};
+    char *fname;
+    int format, has_box = 0;
+    Py_ssize_t chunk_size = 1000;
+    pysander_Trajectory *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|ni", kwlist, &fname,
+                                     &format, &chunk_size, &has_box))
+        return NULL;
+
+    if (format != TRAJ_NETCDF && format != TRAJ_MDCRD) {
+        PyErr_SetString(PyExc_ValueError, "Unrecognized trajectory format");
+        return NULL;
+    }
+    if (chunk_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+
+    self = (pysander_Trajectory *) type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->format = format;
+    self->chunk_size = chunk_size;
+    self->ncid = -1;
+    self->nframes = -1;
+
+    // The frames must match the system that is currently set up
+    pysander_lock();
+    if (IS_SETUP == 0) {
+        pysander_unlock();
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot open a trajectory -- no system set up");
+        goto error;
+    }
+    double a, b, c;
+    self->natom = NATOM;
+    self->setup_count = SETUP_COUNT;
+    get_box(&a, &b, &c, &self->angles[0], &self->angles[1], &self->angles[2]);
+    pysander_unlock();
+
+    if (format == TRAJ_NETCDF) {
+        if (pysander_Trajectory_open_netcdf(self, fname))
+            goto error;
+    } else {
+        char line[1024];
+        self->has_box = has_box;
+        self->fp = fopen(fname, "r");
+        if (self->fp == NULL) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, fname);
+            goto error;
+        }
+        // Skip the title line
+        if (fgets(line, sizeof(line), self->fp) == NULL) {
+            PyErr_Format(PyExc_ValueError, "%s is empty", fname);
+            goto error;
+        }
+    }
+
+    self->coords = (double *) malloc(chunk_size * 3 * self->natom *
+                                     sizeof(double));
+    self->boxes = (double *) malloc(chunk_size * 6 * sizeof(double));
+    if (format == TRAJ_NETCDF)
+        self->cell = (double *) malloc(chunk_size * 6 * sizeof(double));
+    if (self->coords == NULL || self->boxes == NULL ||
+            (format == TRAJ_NETCDF && self->cell == NULL)) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    return (PyObject *) self;
+
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+/* Reads a line from an mdcrd file and parses its 8-character-wide fields into
+ * values, reading at most maxvals numbers. Returns the number of values read,
+ * 0 at the end of the file, or -1 for a malformed line
+ */
+static int
+pysander_mdcrd_read_line(FILE *fp, double *values, int maxvals) {
+    char line[1024], field[9];
+    char *end;
+    int n = 0;
+    size_t len, pos;
+
+    if (fgets(line, sizeof(line), fp) == NULL)
+        return 0;
+    len = strlen(line);
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+        line[--len] = '\0';
+    field[8] = '\0';
+    for (pos = 0; pos + 8 <= len && n < maxvals; pos += 8) {
+        memcpy(field, line + pos, 8);
+        values[n] = strtod(field, &end);
+        if (end == field)
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+/* Reads up to nframes frames into the coordinate and box buffers. Runs without
+ * the GIL, so it reports errors through errmsg. Returns the number of frames
+ * read, or -1 on error
+ */
+static Py_ssize_t
+pysander_Trajectory_read(pysander_Trajectory *self, Py_ssize_t nframes,
+                         char *errmsg, size_t errlen) {
+    Py_ssize_t natom3 = 3 * (Py_ssize_t) self->natom;
+    Py_ssize_t i, j;
+
+    if (!pysander_Trajectory_is_open(self)) {
+        snprintf(errmsg, errlen, "I/O operation on closed trajectory");
+        return -1;
+    }
+
+    if (self->format == TRAJ_NETCDF) {
+        size_t start[3], count[3];
+        int err;
+        if (nframes > self->nframes - self->frame)
+            nframes = self->nframes - self->frame;
+        if (nframes <= 0)
+            return 0;
+        start[0] = self->frame; start[1] = 0; start[2] = 0;
+        count[0] = nframes; count[1] = self->natom; count[2] = 3;
+        // netcdf converts the (usually single precision) data to double
+        err = nc_get_vara_double(self->ncid, self->coord_id, start, count,
+                                 self->coords);
+        if (err == NC_NOERR && self->has_box) {
+            // Lengths and angles are separate (frame, 3) variables. Read them
+            // back-to-back, then interleave them into (a, b, c, alpha, ...)
+            count[1] = 3;
+            err = nc_get_vara_double(self->ncid, self->length_id, start,
+                                     count, self->cell);
+            if (err == NC_NOERR)
+                err = nc_get_vara_double(self->ncid, self->angle_id, start,
+                                         count, self->cell + 3 * nframes);
+            for (i = 0; i < nframes; i++)
+                for (j = 0; j < 3; j++) {
+                    self->boxes[6*i+j] = self->cell[3*i+j];
+                    self->boxes[6*i+3+j] = self->cell[3*nframes + 3*i + j];
+                }
+        }
+        if (err != NC_NOERR) {
+            snprintf(errmsg, errlen, "Error reading frame %zd: %s",
+                     self->frame, nc_strerror(err));
+            return -1;
+        }
+        self->frame += nframes;
+        return nframes;
+    }
+
+    // mdcrd: 10 coordinates per line, then an optional line with the box
+    for (i = 0; i < nframes; i++) {
+        double *crd = self->coords + natom3 * i;
+        Py_ssize_t nread = 0;
+        while (nread < natom3) {
+            int n = pysander_mdcrd_read_line(self->fp, crd + nread,
+                                             natom3 - nread < 10 ?
+                                             (int) (natom3 - nread) : 10);
+            if (n == 0 && nread == 0)
+                return i; // Clean end of the file
+            if (n <= 0) {
+                snprintf(errmsg, errlen, "Frame %zd is truncated or corrupt",
+                         self->frame);
+                return -1;
+            }
+            nread += n;
+        }
+        if (self->has_box) {
+            double *box = self->boxes + 6 * i;
+            if (pysander_mdcrd_read_line(self->fp, box, 3) != 3) {
+                snprintf(errmsg, errlen, "Frame %zd is missing its box",
+                         self->frame);
+                return -1;
+            }
+            box[3] = self->angles[0];
+            box[4] = self->angles[1];
+            box[5] = self->angles[2];
+        }
+        self->frame++;
+    }
+    return nframes;
+}
+
+/* Reads the next chunk of frames and evaluates them, writing energies (and
+ * optionally forces) into the passed buffers. The number of frames in a chunk
+ * is the smaller of chunk_size and the capacity of the energies buffer.
+ * Returns the number of frames evaluated, which is 0 when the trajectory is
+ * exhausted
+ */
+static PyObject *
+pysander_Trajectory_evaluate(pysander_Trajectory *self, PyObject *args) {
+
+    PyObject *pyenergies, *pyforces = Py_None;
+    Py_buffer energies_view, forces_view;
+    double *energies, *forces = NULL;
+    Py_ssize_t natom3 = 3 * (Py_ssize_t) self->natom;
+    Py_ssize_t nframes, i;
+    char errmsg[256];
+    unsigned long long t_in = pysander_now(), t_call = 0, t_out = 0;
+
+    if (!PyArg_ParseTuple(args, "O|O", &pyenergies, &pyforces))
+        return NULL;
+
+    if (!pysander_Trajectory_is_open(self)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed trajectory");
+        return NULL;
+    }
+
+    energies = pysander_get_output_doubles(pyenergies, -1, "energies",
+                                           &energies_view);
+    if (energies == NULL)
+        return NULL;
+    nframes = energies_view.len / (Py_ssize_t) sizeof(double) / NUM_ENERGY_TERMS;
+    if (nframes == 0) {
+        PyBuffer_Release(&energies_view);
+        PyErr_Format(PyExc_ValueError,
+                     "energies must have room for at least one frame (%d "
+                     "elements)", NUM_ENERGY_TERMS);
+        return NULL;
+    }
+    if (nframes > self->chunk_size)
+        nframes = self->chunk_size;
+    if (pyforces != Py_None) {
+        forces = pysander_get_output_doubles(pyforces,
+                        nframes * natom3, "forces", &forces_view);
+        if (forces == NULL) {
+            PyBuffer_Release(&energies_view);
+            return NULL;
+        }
+    }
+
+    pysander_lock();
+
+    if (IS_SETUP == 0 || SETUP_COUNT != self->setup_count) {
+        pysander_unlock();
+        PyErr_SetString(PyExc_RuntimeError,
+                        "The system the trajectory was opened for is no "
+                        "longer set up");
+        nframes = -2;
+    } else if (!pysander_Trajectory_is_open(self)) {
+        pysander_unlock();
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed trajectory");
+        nframes = -2;
+    } else {
+        // The sander call time includes reading the frames from the file
+        POS_VALID = 0;
+        t_call = pysander_now();
+        Py_BEGIN_ALLOW_THREADS
+        nframes = pysander_Trajectory_read(self, nframes, errmsg,
+                                           sizeof(errmsg));
+        pot_ene ene;
+        for (i = 0; i < nframes; i++) {
+            if (self->has_box) {
+                double *box = self->boxes + 6 * i;
+                set_box(box[0], box[1], box[2], box[3], box[4], box[5]);
+            }
+            set_positions(self->coords + natom3 * i);
+            energy_forces(&ene, forces ? forces + natom3 * i : SCRATCH_FULL);
+            pysander_pot_ene_to_array(&ene, energies + NUM_ENERGY_TERMS * i);
+        }
+        Py_END_ALLOW_THREADS
+        t_out = pysander_now();
+        pysander_unlock();
+    }
+
+    if (forces)
+        PyBuffer_Release(&forces_view);
+    PyBuffer_Release(&energies_view);
+
+    if (nframes == -1)
+        PyErr_SetString(PyExc_IOError, errmsg);
+    if (nframes < 0)
+        return NULL;
+
+    pysander_stats_record(STAT_TRAJECTORY, t_in, t_call, t_out, 0, 0);
+    return PyInt_FromLong((long int) nframes);
+}
+
+static PyObject *
+pysander_Trajectory_close(pysander_Trajectory *self) {
+    // Not while another thread is reading from the file in evaluate
+    pysander_lock();
+    pysander_Trajectory_close_file(self);
+    pysander_unlock();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef pysander_TrajectoryMethods[] = {
+    {"evaluate", (PyCFunction) pysander_Trajectory_evaluate, METH_VARARGS,
+            "Reads the next chunk of frames and computes their energies and\n"
+            "forces.\n"
+            "\n"
+            "Parameters\n"
+            "----------\n"
+            "   energies : writable float64 buffer of nframes*nterms elements\n"
+            "   forces : writable float64 buffer of nframes*natom*3 elements,\n"
+            "            or None if forces are not needed\n"
+            "\n"
+            "Returns\n"
+            "-------\n"
+            "   nframes : int\n"
+            "       The number of frames evaluated (0 at the end of the file)"},
+    {"close", (PyCFunction) pysander_Trajectory_close, METH_NOARGS,
+            "Closes the trajectory file"},
+    {NULL} /* sentinel */
+};
+
+static PyMemberDef pysander_TrajectoryMembers[] = {
+    {"natom", T_INT, offsetof(pysander_Trajectory, natom), READONLY,
+                "Number of atoms in each frame"},
+    {"has_box", T_INT, offsetof(pysander_Trajectory, has_box), READONLY,
+                "Whether the frames have unit cell information"},
+    {"chunk_size", T_PYSSIZET, offsetof(pysander_Trajectory, chunk_size),
+                READONLY, "Maximum number of frames evaluated at once"},
+    {"frame", T_PYSSIZET, offsetof(pysander_Trajectory, frame), READONLY,
+                "Index of the next frame to be read"},
+    {"nframes", T_PYSSIZET, offsetof(pysander_Trajectory, nframes), READONLY,
+                "Number of frames in the file (-1 if not known in advance)"},
+    {NULL} /* sentinel */
+};
+
+static PyTypeObject pysander_TrajectoryType = {
+#if PY_MAJOR_VERSION >= 3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                              // ob_size
+#endif
+    "sander.pysander.Trajectory",   // tp_name
+    sizeof(pysander_Trajectory),    // tp_basicsize
+    0,                              // tp_itemsize
+    (destructor)pysander_Trajectory_dealloc, // tp_dealloc
+    0,                              // tp_print
+    0,                              // tp_getattr
+    0,                              // tp_setattr
+    0,                              // tp_compare
+    0,                              // tp_repr
+    0,                              // tp_as_number
+    0,                              // tp_as_sequence
+    0,                              // tp_as_mapping
+    0,                              // tp_hash
+    0,                              // tp_call
+    0,                              // tp_str
+    0,                              // tp_getattro
+    0,                              // tp_setattro
+    0,                              // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,             // tp_flags
+    "Trajectory(filename, format, chunk_size=1000, has_box=0)\n"
+    "\n"
+    "Streams frames from an Amber NetCDF (format=0) or ASCII mdcrd\n"
+    "(format=1) trajectory for evaluation with the active system", // tp_doc
+    0,		                        // tp_traverse
+    0,		                        // tp_clear
+    0,		                        // tp_richcompare
+    0,		                        // tp_weaklistoffset
+    0,		                        // tp_iter
+    0,		                        // tp_iternext
+    pysander_TrajectoryMethods,     // tp_methods
+    pysander_TrajectoryMembers,     // tp_members
+    0,                              // tp_getset
+    0,                              // tp_base
+    0,                              // tp_dict
+    0,                              // tp_descr_get
+    0,                              // tp_descr_set
+    0,                              // tp_dictoffset
+    0,                              // tp_init
+    0,                              // tp_alloc
+    (newfunc)pysander_Trajectory_new, // tp_new
+};
@@ -26,15 +26,29 @@ try:
     pysander = Extension('sander.pysander',
                          sources=['sander/src/pysandermodule.c'],
                          include_dirs=incdir, library_dirs=libdir,
-                         libraries=['sander'],
+                         libraries=['sander', 'netcdf'],
                          depends=['sander/src/pysandermoduletypes.c',
+                                  'sander/src/pysandertrajectory.c',
+                                  'sander/src/pysanderminimize.c',
+                                  'sander/src/pysanderrandom.c',
+                                  'sander/src/pysanderdynamics.c',
+                                  'sander/src/pysandergroups.c',
+                                  'sander/src/pysandercache.c',
+                                  'sander/src/pysandermc.c',
                                   join(incdir[1], 'CompatibilityMacros.h')],
     )
     pysanderles = Extension('sanderles.pysander',
                             sources=['sanderles/src/pysandermodule.c'],
                             include_dirs=incdir, library_dirs=libdir,
-                            libraries=['sanderles'],
+                            libraries=['sanderles', 'netcdf'],
                             depends=['sander/src/pysandermoduletypes.c',
+                                     'sander/src/pysandertrajectory.c',
+                                     'sander/src/pysanderminimize.c',
+                                     'sander/src/pysanderrandom.c',
+                                     'sander/src/pysanderdynamics.c',
+                                     'sander/src/pysandergroups.c',
+                                     'sander/src/pysandercache.c',
+                                     'sander/src/pysandermc.c',
                                      join(incdir[1], 'CompatibilityMacros.h')],
                             define_macros=[('LES', None)])
     setup(name='sander',
@@ -0,0 +1,57 @@
+"""
+Shared fixtures for the pysander tests. The tests run against a small box of
+water (81 atoms) built with ParmEd by the water_box and water_prmtop helpers of
+benchmark.py, evaluated with a Generalized Born input, so they need nothing
+but pysander and ParmEd.
+
+Run them from the top of the repository with
+
+    python -m unittest discover -s test
+"""
+from __future__ import print_function, division, absolute_import
+
+import os
+import shutil
+import sys
+import tempfile
+import unittest
+import numpy as np
+import sander
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                             os.pardir))
+from benchmark import water_box, water_prmtop
+
+NATOM = 81
+
+def perturbed_frames(x0, nframes, scale=0.05, seed=1):
+    """ nframes copies of x0 with small random displacements """
+    rng = np.random.RandomState(seed)
+    return x0 + scale * rng.uniform(-1, 1, (nframes,) + x0.shape)
+
+class SanderTestCase(unittest.TestCase):
+    """ Sets up the water box for every test and cleans up afterwards """
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmpdir = tempfile.mkdtemp()
+        cls.prmtop = water_prmtop(NATOM, cls.tmpdir)
+        cls.x0 = np.asarray(water_box(NATOM)[0], dtype=np.float64)
+        cls.natom = len(cls.x0)
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.tmpdir, ignore_errors=True)
+
+    def setUp(self):
+        sander.setup(self.prmtop, self.x0, None, sander.gas_input(1))
+
+    def tearDown(self):
+        if sander.is_setup():
+            sander.cleanup()
+
+    def assertArraysClose(self, a1, a2, atol=1e-6):
+        a1, a2 = np.asarray(a1), np.asarray(a2)
+        self.assertEqual(a1.shape, a2.shape)
+        self.assertTrue(np.allclose(a1, a2, rtol=0, atol=atol),
+                        'largest difference %g' % np.abs(a1 - a2).max())
@@ -0,0 +1,49 @@
+""" energy_forces_batch must give the same results as frame-by-frame calls """
+from __future__ import print_function, division, absolute_import
+
+import unittest
+import numpy as np
+import sander
+from sandertest import SanderTestCase, perturbed_frames
+
+class TestEnergyForcesBatch(SanderTestCase):
+
+    def _reference(self, frames, boxes=None):
+        energies, forces = [], []
+        for i, x in enumerate(frames):
+            sander.set_positions(x)
+            if boxes is not None:
+                sander.set_box(*boxes[i])
+            e, f = sander.energy_forces(as_numpy=True)
+            energies.append(np.asarray(e))
+            forces.append(f.reshape((-1, 3)))
+        return np.array(energies), np.array(forces)
+
+    def test_matches_energy_forces(self):
+        frames = perturbed_frames(self.x0, 5)
+        ref_e, ref_f = self._reference(frames)
+        e, f = sander.energy_forces_batch(frames)
+        self.assertEqual(e.shape, (5, len(sander.ENERGY_TERMS)))
+        self.assertEqual(f.shape, (5, self.natom, 3))
+        self.assertArraysClose(e, ref_e)
+        self.assertArraysClose(f, ref_f)
+        # The last frame is left active
+        self.assertArraysClose(sander.get_positions(as_numpy=True),
+                               frames[-1].ravel())
+
+    def test_energies_only(self):
+        frames = perturbed_frames(self.x0, 3)
+        ref_e, _ = self._reference(frames)
+        e, f = sander.energy_forces_batch(frames.reshape((3, -1)),
+                                          forces=False)
+        self.assertIs(f, None)
+        self.assertArraysClose(e, ref_e)
+
+    def test_bad_shapes(self):
+        self.assertRaises(ValueError, sander.energy_forces_batch,
+                          np.zeros(3 * self.natom + 1))
+        self.assertRaises(ValueError, sander.energy_forces_batch,
+                          perturbed_frames(self.x0, 2), np.zeros((3, 6)))
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,95 @@
+""" The result cache must return what an evaluation would, and only then """
+from __future__ import print_function, division, absolute_import
+
+import unittest
+import numpy as np
+import sander
+from sandertest import SanderTestCase, perturbed_frames
+
+class TestCache(SanderTestCase):
+
+    def setUp(self):
+        super(TestCache, self).setUp()
+        self.frames = perturbed_frames(self.x0, 3)
+        # Uncached results to compare with
+        sander.set_cache(0)
+        self.ref = [sander.evaluate(x, as_numpy=True) for x in self.frames]
+        sander.clear_cache()
+
+    def tearDown(self):
+        sander.set_cache(0)
+        sander.clear_cache()
+        super(TestCache, self).tearDown()
+
+    def assertResult(self, result, i):
+        e, f = result
+        self.assertArraysClose(np.asarray(e), np.asarray(self.ref[i][0]))
+        self.assertArraysClose(f, self.ref[i][1])
+
+    def assertCounts(self, hits, misses, entries):
+        info = sander.cache_info()
+        self.assertEqual((info['hits'], info['misses'], info['entries']),
+                         (hits, misses, entries))
+
+    def test_hits_and_misses(self):
+        sander.set_cache(4)
+        self.assertResult(sander.evaluate(self.frames[0], as_numpy=True), 0)
+        self.assertCounts(0, 1, 1)
+        self.assertResult(sander.evaluate(self.frames[0], as_numpy=True), 0)
+        self.assertCounts(1, 1, 1)
+        # energy_forces looks up the active positions
+        self.assertResult(sander.energy_forces(as_numpy=True), 0)
+        self.assertCounts(2, 1, 1)
+        self.assertResult(sander.evaluate(self.frames[1], as_numpy=True), 1)
+        self.assertCounts(2, 2, 2)
+        self.assertResult(sander.evaluate(self.frames[0], as_numpy=True), 0)
+        self.assertCounts(3, 2, 2)
+
+    def test_eviction(self):
+        sander.set_cache(2)
+        for i in (0, 1, 2):
+            sander.evaluate(self.frames[i], as_numpy=True)
+        self.assertCounts(0, 3, 2)
+        # The least recently used structure is gone
+        self.assertResult(sander.evaluate(self.frames[0], as_numpy=True), 0)
+        self.assertCounts(0, 4, 2)
+        self.assertResult(sander.evaluate(self.frames[2], as_numpy=True), 2)
+        self.assertCounts(1, 4, 2)
+
+    def test_tolerance(self):
+        sander.set_cache(4, 1e-3)
+        self.assertEqual(sander.cache_info()['tolerance'], 1e-3)
+        sander.evaluate(self.frames[0], as_numpy=True)
+        # Within the tolerance, the stored result is returned
+        self.assertResult(sander.evaluate(self.frames[0] + 5e-4,
+                                          as_numpy=True), 0)
+        self.assertCounts(1, 1, 1)
+        # Beyond it, the structure is evaluated
+        e, f = sander.evaluate(self.frames[0] + 5e-3, as_numpy=True)
+        self.assertCounts(1, 2, 2)
+        self.assertFalse(np.allclose(f, self.ref[0][1], rtol=0, atol=1e-9))
+
+    def test_clear_and_disable(self):
+        sander.set_cache(4)
+        sander.evaluate(self.frames[0], as_numpy=True)
+        sander.evaluate(self.frames[0], as_numpy=True)
+        sander.clear_cache()
+        self.assertCounts(0, 0, 0)
+        self.assertEqual(sander.cache_info()['size'], 4)
+        sander.set_cache(0)
+        for i in range(2):
+            self.assertResult(sander.evaluate(self.frames[0], as_numpy=True),
+                              0)
+        self.assertCounts(0, 0, 0)
+
+    def test_cleanup_drops_entries(self):
+        sander.set_cache(4)
+        sander.evaluate(self.frames[0], as_numpy=True)
+        sander.cleanup()
+        sander.setup(self.prmtop, self.x0, None, sander.gas_input(1))
+        self.assertEqual(sander.cache_info()['entries'], 0)
+        self.assertResult(sander.evaluate(self.frames[0], as_numpy=True), 0)
+        self.assertCounts(0, 2, 1)
+
+if __name__ == '__main__':
+    unittest.main()
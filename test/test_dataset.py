@@ -0,0 +1,92 @@
+""" A DatasetReader must return what was given to a DatasetWriter """
+from __future__ import print_function, division, absolute_import
+
+import os
+import shutil
+import tempfile
+import unittest
+import numpy as np
+import sander
+from sander import dataset
+from sandertest import SanderTestCase, perturbed_frames
+
+class TestDataset(SanderTestCase):
+
+    def setUp(self):
+        super(TestDataset, self).setUp()
+        self.directory = tempfile.mkdtemp(dir=self.tmpdir)
+
+    def tearDown(self):
+        shutil.rmtree(self.directory, ignore_errors=True)
+        super(TestDataset, self).tearDown()
+
+    def _round_trip(self, dtype, compression):
+        directory = os.path.join(self.directory, '%s-%s' %
+                                 (np.dtype(dtype).name, compression))
+        batches = [perturbed_frames(self.x0, 4, seed=i) for i in range(5)]
+        ref_e, ref_f = sander.energy_forces_batch(np.concatenate(batches))
+        # Small shards, so the batches are spread over several files
+        writer = sander.DatasetWriter(directory, dtype=dtype,
+                                      compression=compression,
+                                      max_shard_bytes=20000)
+        frames = np.empty_like(batches[0])
+        with writer:
+            for batch in batches:
+                # The same buffer is refilled while the last batch may still
+                # be waiting to be written
+                frames[:] = batch
+                writer.evaluate(frames)
+                frames[:] = np.nan
+        reader = sander.DatasetReader(directory)
+        self.assertEqual(len(reader), 20)
+        self.assertEqual(reader.natom, self.natom)
+        self.assertEqual(reader.terms, list(sander.ENERGY_TERMS))
+        self.assertEqual(reader.dtype, np.dtype(dtype))
+        self.assertGreater(len(reader.index['shards']), 1)
+        data = reader.load()
+        atol = 1e-6 if dtype == np.float64 else 1e-4
+        self.assertArraysClose(data['energies'], ref_e)
+        self.assertEqual(data['forces'].dtype, np.dtype(dtype))
+        self.assertArraysClose(data['forces'], ref_f, atol=atol)
+        self.assertArraysClose(data['positions'], np.concatenate(batches),
+                               atol=atol)
+
+    def test_round_trip(self):
+        for dtype in (np.float64, np.float32):
+            for compression in (None, 'zlib', 'lzma'):
+                if compression == 'lzma' and dataset._lzma is None:
+                    continue
+                self._round_trip(dtype, compression)
+
+    def test_append(self):
+        frames = perturbed_frames(self.x0, 3)
+        e, f = sander.energy_forces_batch(frames)
+        sander.set_positions(frames[0])
+        single = sander.energy_forces()[0]
+        with sander.DatasetWriter(self.directory, positions=False,
+                                  compression='zlib') as writer:
+            writer.append(e, f)
+            writer.append(single, f[:1])
+            # Appended arrays are copied by default
+            f[:] = 0
+        data = sander.DatasetReader(self.directory).load()
+        self.assertNotIn('positions', data)
+        self.assertEqual(data['energies'].shape,
+                         (4, len(sander.ENERGY_TERMS)))
+        self.assertArraysClose(data['energies'][3], data['energies'][0])
+        self.assertFalse((data['forces'] == 0).all())
+        self.assertArraysClose(data['forces'][3], data['forces'][0])
+
+    def test_errors(self):
+        with sander.DatasetWriter(self.directory) as writer:
+            self.assertRaises(ValueError, writer.append,
+                              np.zeros((1, len(sander.ENERGY_TERMS))))
+        self.assertRaises(RuntimeError, writer.append,
+                          np.zeros((1, len(sander.ENERGY_TERMS))))
+        self.assertRaises(IOError, sander.DatasetWriter, self.directory)
+        self.assertRaises(ValueError, sander.DatasetWriter,
+                          os.path.join(self.directory, 'x'),
+                          compression='bz2')
+
+if __name__ == '__main__':
+    unittest.main()
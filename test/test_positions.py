@@ -0,0 +1,58 @@
+""" update_positions must leave the same state as set_positions would """
+from __future__ import print_function, division, absolute_import
+
+import unittest
+import numpy as np
+import sander
+from sandertest import SanderTestCase, perturbed_frames
+
+class TestUpdatePositions(SanderTestCase):
+
+    def assertActive(self, expected):
+        """ Checks the active positions, and their energies and forces """
+        x = sander.get_positions(as_numpy=True)
+        self.assertArraysClose(x, expected.ravel(), atol=0)
+        e, f = sander.energy_forces(as_numpy=True)
+        sander.set_positions(expected)
+        ref_e, ref_f = sander.energy_forces(as_numpy=True)
+        self.assertArraysClose(np.asarray(e), np.asarray(ref_e))
+        self.assertArraysClose(f, ref_f)
+
+    def test_matches_set_positions(self):
+        frames = perturbed_frames(self.x0, 3)
+        expected = self.x0.copy()
+        moves = [(np.array([0, 1, 2]), frames[0][:3]),
+                 (np.array([5, 40, 80], dtype=np.int32),
+                  frames[1][[5, 40, 80]]),
+                 ([3, 4], frames[2][3:5].ravel()),
+                 (np.arange(self.natom), frames[2].astype(np.float32))]
+        for indices, coords in moves:
+            sander.update_positions(indices, coords)
+            expected[np.asarray(indices)] = np.reshape(coords, (-1, 3))
+            self.assertActive(expected)
+
+    def test_after_other_moves(self):
+        # Every way of replacing the positions must be seen by the next update
+        frames = perturbed_frames(self.x0, 7)
+        sander.update_positions([0], frames[0][0])
+        moves = (lambda x: sander.set_positions(x),
+                 lambda x: sander.evaluate(x),
+                 lambda x: sander.energy_forces_batch(x[None]))
+        for i, move in enumerate(moves):
+            expected = frames[2*i+1].copy()
+            move(expected)
+            sander.update_positions([7, 8], frames[2*i+2][7:9])
+            expected[7:9] = frames[2*i+2][7:9]
+            self.assertActive(expected)
+
+    def test_bad_arguments(self):
+        self.assertRaises(IndexError, sander.update_positions, [self.natom],
+                          np.zeros(3))
+        self.assertRaises(ValueError, sander.update_positions, [0, 1],
+                          np.zeros(3))
+        sander.cleanup()
+        self.assertRaises(RuntimeError, sander.update_positions, [0],
+                          np.zeros(3))
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,76 @@
+""" iter_trajectory must give the same results as energy_forces_batch """
+from __future__ import print_function, division, absolute_import
+
+import os
+import unittest
+import numpy as np
+import sander
+from sandertest import SanderTestCase, perturbed_frames
+
+NFRAMES = 7
+
+def write_mdcrd(fname, frames):
+    """ Writes frames as an ASCII mdcrd file, 10 coordinates per line """
+    with open(fname, 'w') as f:
+        f.write('test trajectory\n')
+        for x in frames:
+            x = x.ravel()
+            for i in range(0, len(x), 10):
+                f.write(''.join('%8.3f' % v for v in x[i:i+10]) + '\n')
+
+class TestTrajectory(SanderTestCase):
+
+    def setUp(self):
+        super(TestTrajectory, self).setUp()
+        self.frames = np.round(perturbed_frames(self.x0, NFRAMES), 3)
+
+    def _check(self, fname, format=None, chunk_size=3):
+        ref_e, ref_f = sander.energy_forces_batch(self.frames)
+        energies, forces = [], []
+        for e, f in sander.iter_trajectory(fname, chunk_size=chunk_size,
+                                           forces=True, format=format):
+            self.assertLessEqual(len(e), chunk_size)
+            energies.append(e)
+            forces.append(f)
+        self.assertArraysClose(np.concatenate(energies), ref_e, atol=1e-4)
+        self.assertArraysClose(np.concatenate(forces), ref_f, atol=1e-4)
+
+    def test_mdcrd(self):
+        fname = os.path.join(self.tmpdir, 'test.mdcrd')
+        write_mdcrd(fname, self.frames)
+        self._check(fname)
+        self._check(fname, format='mdcrd', chunk_size=NFRAMES + 1)
+
+    def test_netcdf(self):
+        from parmed.amber import NetCDFTraj
+        fname = os.path.join(self.tmpdir, 'test.nc')
+        traj = NetCDFTraj.open_new(fname, self.natom, box=False)
+        for x in self.frames:
+            traj.add_coordinates(x)
+        traj.close()
+        self._check(fname)
+        self._check(fname, format='netcdf', chunk_size=1)
+
+    def test_closed(self):
+        fname = os.path.join(self.tmpdir, 'closed.mdcrd')
+        write_mdcrd(fname, self.frames)
+        traj = sander.pysander.Trajectory(fname, 1, 2, False)
+        traj.close()
+        self.assertRaises(ValueError, traj.evaluate,
+                          np.empty((2, len(sander.ENERGY_TERMS))), None)
+
+    def test_stale_system(self):
+        fname = os.path.join(self.tmpdir, 'stale.mdcrd')
+        write_mdcrd(fname, self.frames)
+        traj = sander.pysander.Trajectory(fname, 1, 2, False)
+        try:
+            # Same number of atoms, but a different system
+            sander.cleanup()
+            sander.setup(self.prmtop, self.x0, None, sander.gas_input(1))
+            self.assertRaises(RuntimeError, traj.evaluate,
+                              np.empty((2, len(sander.ENERGY_TERMS))), None)
+        finally:
+            traj.close()
+
+if __name__ == '__main__':
+    unittest.main()